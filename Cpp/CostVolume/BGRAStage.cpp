@@ -0,0 +1,158 @@
+// Free for non-commercial, non-military, and non-critical
+// use unless incorporated in OpenCV.
+// Inherits OpenCV License if in OpenCV.
+
+#include "BGRAStage.hpp"
+#include "utils/Profiler.hpp"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+#include <functional>
+
+using namespace cv;
+using namespace std;
+
+#if CV_SIMD128
+static inline v_uint8x16 packU8(const v_float32x4& a,const v_float32x4& b,const v_float32x4& c,const v_float32x4& d){
+    return v_pack_u(v_pack(v_round(a),v_round(b)),v_pack(v_round(c),v_round(d)));//saturating
+}
+#endif
+
+//BGR float [0,1] -> BGRA8888, 16 pixels a step
+static void float3ToBGRA(const float* s,uchar* d,int n){
+    int i=0;
+#if CV_SIMD128
+    const v_float32x4 k=v_setall_f32(255.f);
+    const v_uint8x16 alpha=v_setall_u8(255);
+    for(;i<=n-16;i+=16,s+=48,d+=64){
+        v_float32x4 b0,g0,r0,b1,g1,r1,b2,g2,r2,b3,g3,r3;
+        v_load_deinterleave(s,   b0,g0,r0);
+        v_load_deinterleave(s+12,b1,g1,r1);
+        v_load_deinterleave(s+24,b2,g2,r2);
+        v_load_deinterleave(s+36,b3,g3,r3);
+        v_store_interleave(d,packU8(b0*k,b1*k,b2*k,b3*k),
+                             packU8(g0*k,g1*k,g2*k,g3*k),
+                             packU8(r0*k,r1*k,r2*k,r3*k),
+                             alpha);
+    }
+#endif
+    for(;i<n;i++,s+=3,d+=4){
+        d[0]=saturate_cast<uchar>(s[0]*255.f);
+        d[1]=saturate_cast<uchar>(s[1]*255.f);
+        d[2]=saturate_cast<uchar>(s[2]*255.f);
+        d[3]=255;
+    }
+}
+
+void BGRAStage::convert(const Mat& image,Mat& bgra){
+    CV_Assert(bgra.size()==image.size() && bgra.type()==CV_8UC4);
+    int type=image.type();
+    if(type==CV_32FC3){
+        for(int i=0;i<image.rows;i++)
+            float3ToBGRA(image.ptr<float>(i),bgra.ptr<uchar>(i),image.cols);
+    }else if(type==CV_8UC4){
+        image.copyTo(bgra);
+    }else if(type==CV_8UC1||type==CV_8SC1){
+        cv::cvtColor(image,bgra,cv::COLOR_GRAY2BGRA);
+    }else if(type==CV_8UC3||type==CV_8SC3){
+        cv::cvtColor(image,bgra,cv::COLOR_BGR2BGRA);
+    }else{
+        Mat four=image;
+        if(image.channels()==1){
+            cv::cvtColor(image,four,cv::COLOR_GRAY2BGRA);
+        }
+        if(image.channels()==3){
+            cv::cvtColor(image,four,cv::COLOR_BGR2BGRA);
+        }
+        //four channel, unknown depth but not 8 bit
+        if(image.depth()>=5){//float
+            four.convertTo(bgra,CV_8U,255.0);
+        }else{//0-65535
+            four.convertTo(bgra,CV_8U,1/256.0);
+        }
+    }
+}
+
+BGRAStage::BGRAStage(int n):slots(n>0 ? n : 1),nextTicket(0){
+    for(size_t i=0;i<slots.size();i++){
+        slots[i].state=SLOT_FREE;
+        slots[i].ticket=-1;
+        cudaEventCreateWithFlags(&slots[i].uploaded,cudaEventDisableTiming);
+    }
+}
+
+BGRAStage::~BGRAStage(){
+    TaskPool::global().wait(inflight);
+    for(size_t i=0;i<slots.size();i++){
+        if(slots[i].state==SLOT_UPLOADING)
+            cudaEventSynchronize(slots[i].uploaded);//the copy still reads the buffer
+        cudaEventDestroy(slots[i].uploaded);
+    }
+}
+
+BGRAStage::Slot* BGRAStage::find(int ticket){
+    for(size_t i=0;i<slots.size();i++){
+        if(slots[i].ticket==ticket && slots[i].state!=SLOT_FREE)
+            return &slots[i];
+    }
+    return NULL;
+}
+
+int BGRAStage::submit(const Mat& image){
+    ScopeLock s(mutex);
+    Slot* slot=NULL;
+    Slot* oldest=NULL;//upload, if every free one is still being read
+    for(size_t i=0;i<slots.size() && !slot;i++){
+        Slot& c=slots[i];
+        if(c.state==SLOT_FREE){
+            slot=&c;
+        }else if(c.state==SLOT_UPLOADING){
+            if(cudaEventQuery(c.uploaded)==cudaSuccess)
+                slot=&c;
+            else if(!oldest || c.ticket<oldest->ticket)
+                oldest=&c;
+        }
+    }
+    if(!slot && oldest){
+        cudaEventSynchronize(oldest->uploaded);
+        slot=oldest;
+    }
+    if(!slot)
+        CV_Error(CV_StsError,"BGRAStage: more images submitted than slots, wait() and release() them first");
+
+    slot->state=SLOT_CONVERTING;
+    slot->ticket=nextTicket++;
+    slot->src=image;
+    if(slot->mem.size()!=image.size() || slot->mem.type()!=CV_8UC4){
+        slot->mem.create(image.rows,image.cols,CV_8UC4);
+        slot->bgra=slot->mem.createMatHeader();
+    }
+    TaskPool::global().submit(std::bind(&BGRAStage::run,this,slot),TASK_MAP,&inflight);
+    return slot->ticket;
+}
+
+void BGRAStage::run(Slot* slot){
+    PROFILE_ZONE("BGRA convert");
+    convert(slot->src,slot->bgra);
+    ScopeLock s(mutex);
+    slot->src.release();
+    slot->state=SLOT_READY;
+    ready.broadcast();
+}
+
+const Mat& BGRAStage::wait(int ticket){
+    ScopeLock s(mutex);
+    Slot* slot=find(ticket);
+    CV_Assert(slot && slot->state!=SLOT_UPLOADING);
+    while(slot->state==SLOT_CONVERTING){
+        ready.wait(mutex);
+    }
+    return slot->bgra;
+}
+
+void BGRAStage::release(int ticket,cudaStream_t stream){
+    ScopeLock s(mutex);
+    Slot* slot=find(ticket);
+    CV_Assert(slot && slot->state==SLOT_READY);
+    cudaEventRecord(slot->uploaded,stream);
+    slot->state=SLOT_UPLOADING;
+}
@@ -0,0 +1,63 @@
+// Free for non-commercial, non-military, and non-critical
+// use unless incorporated in OpenCV.
+// Inherits OpenCV License if in OpenCV.
+
+#ifndef BGRASTAGE_HPP
+#define BGRASTAGE_HPP
+//Converts CostVolume::updateCost input to BGRA8888 off the caller's thread.
+//
+// submit() hands the image to TaskPool::global() and returns a ticket at
+// once. The conversion writes into one of a small ring of pinned buffers,
+// so the texture upload from it is a real async copy. wait() returns the
+// buffer once converted, release() gives it back after the upload queued
+// on a stream; the slot is only reused when the stream has got past it.
+//
+// CV_32FC3 in [0,1], what the pipeline produces, has a SIMD path.
+// Everything else goes through cvtColor/convertTo as before: 8 bit as is,
+// float times 255, 16 bit and wider divided by 256.
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/cuda.hpp>
+#include <cuda_runtime.h>
+#include "Scheduler/ImplMutex.hpp"
+#include "Scheduler/TaskPool.hpp"
+
+class BGRAStage{
+public:
+    explicit BGRAStage(int slots=3);
+    ~BGRAStage();//waits for conversions and uploads in flight
+
+    //The image is not copied, leave it alone until wait() returns.
+    // At most slots images may be submitted and not yet released.
+    int submit(const cv::Mat& image);
+    const cv::Mat& wait(int ticket);
+    void release(int ticket,cudaStream_t stream);
+
+    //The conversion itself, on the calling thread
+    static void convert(const cv::Mat& image,cv::Mat& bgra);
+
+private:
+    enum{SLOT_FREE,SLOT_CONVERTING,SLOT_READY,SLOT_UPLOADING};
+    struct Slot{
+        int state;
+        int ticket;
+        cv::Mat src;
+        cv::cuda::HostMem mem;//page locked
+        cv::Mat bgra;         //header onto mem
+        cudaEvent_t uploaded;
+    };
+
+    Slot* find(int ticket);
+    void run(Slot* slot);
+
+    std::vector<Slot> slots;
+    int nextTicket;
+    ImplMutex mutex;
+    ImplCondVar ready;
+    TaskGroup inflight;
+
+    BGRAStage(const BGRAStage&);
+    BGRAStage& operator = (const BGRAStage&);
+};
+
+#endif // BGRASTAGE_HPP
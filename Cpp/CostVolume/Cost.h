@@ -2,7 +2,8 @@
 #define COST_H
 #include <opencv2/core/core.hpp>
 #include <vector>
-#include "tictoc.h"
+class TaskGroup;
+class StopToken;
 // The cost volume. Conceptually arranged as an image plane, corresponding
 // to the keyframe, lying on top of the actual cost volume, a 3D two channel matrix storing
 // the total cost of all rays that have passed through a voxel, and the number of rays that
@@ -19,6 +20,7 @@
 
 
 class Cost{
+    friend struct CostBench;//bench/kernels.cpp times the private stages
 public:
     cv::Mat rayHits;// number of times a ray has been hit(not implemented)
     cv::Mat_<cv::Vec3f> baseImage;
@@ -50,7 +52,11 @@ public:
     void updateCostL1(const cv::Mat& image, const cv::Mat& R, const cv::Mat& Tr);
     void updateCostL2(const cv::Mat& image, const cv::Matx44d& currentCameraPose);
     void updateCostL2(const cv::Mat& image, const cv::Mat& R, const cv::Mat& Tr);
+    //The optimizer runs on TaskPool::global() until theta reaches thetaMin.
+    // Wait for it before reading depthMap() or destroying the Cost.
     void optimize();
+    bool waitOptimizer(StopToken* stop=NULL);//false if stop came first, it is still running then
+    void stopOptimizer();//ends it after the iterations under way, and waits for those
     void initOptimization();
     
     const cv::Mat depthMap(); //return the best available depth map
@@ -131,7 +137,8 @@ private:
     
     //Thread management
     public:
-        volatile bool running_a, running_qd;
+        volatile bool running_a, running_qd;//clearing running_a asks both iteration chains to stop
+        cv::Ptr<TaskGroup> optimizing;//both chains, done once the last iteration has returned
 };
 
 
@@ -5,6 +5,7 @@
 
 #include "CostVolume.hpp"
 #include "CostVolume.cuh"
+#include "BGRAStage.hpp"
 
 #include <opencv2/core/operations.hpp>
 #include <opencv2/core/cuda_stream_accessor.hpp>
@@ -14,6 +15,7 @@
 #include "utils/utils.hpp"
 #include "utils/tinyMat.hpp"
 #include "graphics.hpp"
+#include "utils/Profiler.hpp"
 #include <iostream>
 
 using namespace std;
@@ -100,6 +102,7 @@ CostVolume::CostVolume(Mat image, FrameID _fid, int _layers, float _near,
     _texObj=Ptr<char>((char*)(new cudaTextureObject_t));
     *((cudaTextureObject_t*)(char*)_texObj)=0;
     ref=Ptr<char>(new char);
+    input=Ptr<BGRAStage>(new BGRAStage);
 }
 
 
@@ -151,6 +154,29 @@ void CostVolume::simpleTex(const Mat& image, Stream cvStream){
 }
 
 void CostVolume::updateCost(const Mat& _image, const cv::Mat& R, const cv::Mat& T){
+    if(_image.type()==CV_8UC4 && _image.isContinuous()){
+        updateCostBGRA(_image,R,T);//no conversion needed
+        return;
+    }
+    updateCost(prepareImage(_image),R,T);
+}
+
+int CostVolume::prepareImage(const Mat& image){
+    return input->submit(image);
+}
+
+void CostVolume::updateCost(int ticket, const cv::Mat& R, const cv::Mat& T){
+    const Mat* image;
+    {
+        PROFILE_ZONE("wait input");
+        image=&input->wait(ticket);
+    }
+    updateCostBGRA(*image,R,T);
+    input->release(ticket,cv::cuda::StreamAccessor::getStream(cvStream));//free once the upload is done
+}
+
+void CostVolume::updateCostBGRA(const Mat& image, const cv::Mat& R, const cv::Mat& T){
+    PROFILE_ZONE("updateCost");
     using namespace cv::cuda::dtam_updateCost;
     localStream = cv::cuda::StreamAccessor::getStream(cvStream);
     
@@ -169,43 +195,7 @@ void CostVolume::updateCost(const Mat& _image, const cv::Mat& R, const cv::Mat&
     //
     // make sure we modify the cameraMatrix to take into account the texture coordinates
     //
-    Mat image;
-    {
-    image=_image;//no copy
-        if(_image.type()!=CV_8UC4 || !_image.isContinuous()){
-            if(!_image.isContinuous()&&_image.type()==CV_8UC4){
-                cBuffer.create(_image.rows,_image.cols,CV_8UC4);
-                image=cBuffer;//.createMatHeader();
-                _image.copyTo(image);//copies data
-                
-            }
-            if(_image.type()!=CV_8UC4){
-                cBuffer.create(_image.rows,_image.cols,CV_8UC4);
-                Mat cm=cBuffer;//.createMatHeader();
-                if(_image.type()==CV_8UC1||_image.type()==CV_8SC1){
-                    cv::cvtColor(_image,cm,cv::COLOR_GRAY2BGRA);
-                }else if(_image.type()==CV_8UC3||_image.type()==CV_8SC3){
-                    cv::cvtColor(_image,cm,cv::COLOR_BGR2BGRA);
-                }else{
-                    image=_image;
-                    if(_image.channels()==1){
-                        cv::cvtColor(image,image,cv::COLOR_GRAY2BGRA);
-                    }
-                    if(_image.channels()==3){
-                        cv::cvtColor(image,image,cv::COLOR_BGR2BGRA);
-                    }
-                    //image is now 4 channel, unknown depth but not 8 bit
-                    if(_image.depth()>=5){//float
-                        image.convertTo(cm,CV_8UC4,255.0);
-                    }else if(image.depth()>=2){//0-65535
-                        image.convertTo(cm,CV_8UC4,1/256.0);
-                    }
-                }
-                image=cm;
-            }
-        }
-        CV_Assert(image.type()==CV_8UC4);
-    }
+    CV_Assert(image.type()==CV_8UC4);
     //change input image to a texture
     //ArrayTexture tex(image, cvStream);
     simpleTex(image,cvStream);
@@ -11,6 +11,7 @@
 #include <opencv2/core/cuda_stream_accessor.hpp>
 
 typedef  int FrameID;
+class BGRAStage;
 
 class CostVolume
 {
@@ -44,6 +45,12 @@ public:
     cv::cuda::Stream cvStream;
 
     void updateCost(const cv::Mat& image, const cv::Mat& R, const cv::Mat& T);//Accepts pinned RGBA8888 or BGRA8888 for high speed
+    //Other formats are converted to BGRA on the task pool, into pinned buffers.
+    // prepareImage starts that early (the image must stay untouched until
+    // its updateCost), so the next image converts while this one updates.
+    // At most 3 may be prepared ahead.
+    int prepareImage(const cv::Mat& image);
+    void updateCost(int prepared, const cv::Mat& R, const cv::Mat& T);
     
     CostVolume(){}
     ~CostVolume();
@@ -64,12 +71,13 @@ private:
     void checkInputs(const cv::Mat& R, const cv::Mat& T,
             const cv::Mat& _cameraMatrix);
     void simpleTex(const cv::Mat& image,cv::cuda::Stream cvStream=cv::cuda::Stream::Null());
+    void updateCostBGRA(const cv::Mat& image, const cv::Mat& R, const cv::Mat& T);
 
 private:
     //temp variables ("static" containers)
     cv::Ptr<char> _cuArray;//Ptr<cudaArray*> really
     cv::Ptr<char> _texObj;//Ptr<cudaTextureObject_t> really
-    cv::Mat cBuffer;//Must be pagable
+    cv::Ptr<BGRAStage> input;//shared by copies, like the cuda objects
     cv::Ptr<char> ref;
 };
 
@@ -6,7 +6,8 @@
 #include <unistd.h>
 #include <cmath>
 #include "graphics.hpp"
-#include "set_affinity.h"
+#include "Scheduler/TaskPool.hpp"
+#include "utils/Profiler.hpp"
 #include "Cost.h"
 //relations: 
 //gwhatever=0.5*(gwhatever+ghere)
@@ -75,9 +76,12 @@ void Cost::computeSigmas(){
 }
 
 void Cost::cacheGValues(){
+    PROFILE_ZONE("cacheGValues");
     int w=cols;
     int h=rows;
+#ifdef DTAM_COST_DEBUG
     cout<< "Caching G values"<<"\n";
+#endif
     _gbig.create(h+2,w,CV_32FC1);  //enough room to safely read off the ends
                                 // data will be garbage, but we don't care since we don't use it anyway
     _g=Mat(h,w,CV_32FC1, (float*)(_gbig.data)+w);
@@ -118,7 +122,6 @@ void Cost::cacheGValues(){
     
     _g=gx+gy;//Getting lazy, just do L1 norm
     
-    toc();
     //The g function (Eq. 5)
     //the paper doesn't specify the values of the exponent or multiplier,
     // so I have chosen them to have a knee at 10% gradient, since this is a 
@@ -233,51 +236,58 @@ inline float Cost::aBasic(float* data,float l,float ds,float d,float& value){
 //     return (A-C)/(A-2*B+C)*.5+float(discreteMin-loind);
 // }
 
-static void* Cost_optimizeQD(void* object);
-static void* Cost_optimizeA(void* object);
+static void Cost_optimizeQD(Cost* cost);
+static void Cost_optimizeA(Cost* cost);
 static void launch_optimzer_thread(Cost& cost);
 
 
-static void launch_optimzer_threads(const Cost* cost){
-    pthread_t threadQD,threadA;
-    pthread_create( &threadQD, NULL, Cost_optimizeQD, (void*) cost);
-    pthread_create( &threadA, NULL, Cost_optimizeA, (void*) cost);
-}
-static void* Cost_optimizeQD(void* object){
-    pthread_setname_np(pthread_self(),"QDthread");
-    Cost* cost = (Cost*)object;
-    set_affinity(2);
+//Each optimizer iteration is one background task on the shared pool that
+// resubmits itself, so tracking can take the core between iterations.
+// Every task is in cost->optimizing, which the next one joins before the
+// current one leaves, so the group is only done once both chains have
+// ended, after the last write to the Cost.
+static void launch_optimzer_threads(Cost* cost){
+    if(cost->optimizing.empty())
+        cost->optimizing=makePtr<TaskGroup>();
     cost->running_qd=true;
-    while(cost->running_a){
-        cost->optimizeQD();
-        if(allDie)
-                    return 0;
-    }
-    cost->running_qd=false;
-}
-static void* Cost_optimizeA(void* object){
-    pthread_setname_np(pthread_self(),"Athread");
-    Cost* cost = (Cost*)object;
-    set_affinity(3);
     cost->running_a=true;
-    while(cost->running_a){
-        cost->optimizeA();
-        if(allDie)
-                    return 0;
+    TaskPool::global().submit(std::bind(Cost_optimizeQD,cost),TASK_REFINE,cost->optimizing.get());
+    TaskPool::global().submit(std::bind(Cost_optimizeA,cost),TASK_REFINE,cost->optimizing.get());
+}
+static void Cost_optimizeQD(Cost* cost){
+    if(!cost->running_a || allDie.stopRequested()){
+        cost->running_qd=false;
+        return;
     }
+    cost->optimizeQD();
+    TaskPool::global().submit(std::bind(Cost_optimizeQD,cost),TASK_REFINE,cost->optimizing.get());
+}
+static void Cost_optimizeA(Cost* cost){
+    if(!cost->running_a || allDie.stopRequested())
+        return;
+    cost->optimizeA();
+    if(cost->running_a)//the final iteration clears it
+        TaskPool::global().submit(std::bind(Cost_optimizeA,cost),TASK_REFINE,cost->optimizing.get());
 }
 
 void Cost::optimize(){
     if(!running_a){
-        // Wait for QD to be done
-        while(running_qd)
-          usleep(100);
+        waitOptimizer();//the last QD iteration may still be out
         launch_optimzer_threads(this);
     }else{
         cout<<"Already running optimizer!"<<"\n";
     }
 }
 
+bool Cost::waitOptimizer(StopToken* stop){
+    return optimizing.empty() || TaskPool::global().wait(*optimizing,stop);
+}
+
+void Cost::stopOptimizer(){
+    running_a=false;
+    waitOptimizer();
+}
+
 static void __attribute__ ((noinline)) qcore(
     const float denom,
     st point, 
@@ -293,9 +303,13 @@ static void __attribute__ ((noinline)) qcore(
     const unsigned& w);
 
 void Cost::optimizeQD(){
+    PROFILE_ZONE("optimizeQD");
     int w=cols;
     int h=rows;
-    cout<< "QD optimization run:"<<QDruncount++<<"\n";
+    QDruncount++;
+#ifdef DTAM_COST_DEBUG
+    cout<< "QD optimization run:"<<QDruncount<<"\n";
+#endif
     float denom;
     st point; 
     st pstop; 
@@ -314,7 +328,7 @@ void Cost::optimizeQD(){
     assert(sigma_d!=0.0);
     
     //q update ((4 read,1 write)*2 = 8 read, 2 write)
-tic();
+{PROFILE_ZONE("q update");
     denom=1+sigma_q*epsilon;
     float nm,pd,kxn,kyn;
     point=0;
@@ -370,9 +384,10 @@ tic();
     //last col,row
     kx[here]=0;
     ky[here]=0;
-toc();
+}
 
     //d update (10 read,1 write per point)
+{PROFILE_ZONE("d update");
     denom=1+sigma_d/theta;
 
     //top left
@@ -427,14 +442,13 @@ toc();
     pstop++;
     d[here] = (d[here]-sigma_d*(          gup*ky[up]               +gleft*kx[left]                              - a[here]/theta))/denom;
     point++;
+}
 
     //debug
 //     pfShow("qx",abs(_qx));
 //     pfShow("d",_d);
 //     pfShow("a",_a);
     assert(aptr==_a.data);
-    gcheck();
-    usleep(1);
     
 
         
@@ -443,6 +457,7 @@ toc();
 }
 
 void Cost::optimizeA(){ 
+    PROFILE_ZONE("optimizeA");
     assert(aptr==_a.data);//_a is read across threads, so needs to never be de/reallocated
     //usleep(1);
     theta=theta*thetaStep;
@@ -451,16 +466,18 @@ void Cost::optimizeA(){
     }
     if (theta<thetaMin){//done optimizing!
         running_a=false;
-        gpause();
 //         initOptimization();
         stableDepth=_d.clone();//always choose more regularized version
         _qx=0.0;
         _qy=0.0;
-        _d=stableDepth.clone();//QD might be running, return the depth to it
+        stableDepth.copyTo(_d);//QD might be running, return the depth to it in its own buffer
         theta=thetaStart;
     }
-    cout<<"A optimization run: "<<Aruncount++<<endl;
+    Aruncount++;
+#ifdef DTAM_COST_DEBUG
+    cout<<"A optimization run: "<<Aruncount<<endl;
     cout<<"                           Current Theta: "<<theta<<endl;
+#endif
     int w=cols;
     int h=rows;
     float* a=(float*)(_a.data);
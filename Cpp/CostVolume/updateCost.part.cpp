@@ -8,7 +8,8 @@
 #include <iostream>
 #include <algorithm>
 #include <opencv2/highgui/highgui.hpp>
-#include "tictoc.h"
+#include "utils/Profiler.hpp"
+#include "Scheduler/TaskPool.hpp"
 #include "graphics.hpp"
 // #define DTAM_COST_DEBUG
 
@@ -24,6 +25,7 @@ static inline float fastabs(const float& foo){
 void Cost::updateCostL1(const cv::Mat& image,
                                      const cv::Matx44d& currentCameraPose)
 {
+    PROFILE_ZONE("updateCostL1");
     imageNum++;
     cv::Mat newLo(rows,cols,CV_32FC1,1000.0);
     newLo=1000.0;
@@ -31,64 +33,64 @@ void Cost::updateCostL1(const cv::Mat& image,
 
     
     cv::Mat newHi(rows,cols,CV_32FC1,0);
-    for(int n=0; n < depth.size(); ++n){
+    //layers touch disjoint voxels, so they are tasks on the shared pool
+    TaskPool::global().parallelFor(0,depth.size(),[&](int nb,int ne){
+        for(int n=nb; n < ne; ++n){
         
-       // tic();
-        cv::Mat_<cv::Vec3f> plane;
-        cv::Mat_<uchar> mask;
-        reproject(cv::Mat_<cv::Vec3f>(image), cameraMatrix, pose, currentCameraPose, depth[n], plane, mask);//could be as fast as .00614 using resize instead. Currently runs at .0156s, or about twice as long
-        size_t end=image.rows*image.cols*image.channels();
-        size_t lstep=layers;
-        #ifdef DTAM_COST_DEBUG
-        float* pdata;
+            PROFILE_ZONE("layer");
+            cv::Mat_<cv::Vec3f> plane;
+            cv::Mat_<uchar> mask;
+            reproject(cv::Mat_<cv::Vec3f>(image), cameraMatrix, pose, currentCameraPose, depth[n], plane, mask);//could be as fast as .00614 using resize instead. Currently runs at .0156s, or about twice as long
+            size_t end=image.rows*image.cols*image.channels();
+            size_t lstep=layers;
+            #ifdef DTAM_COST_DEBUG
+            float* pdata;
 #else
-        const float* pdata;
+            const float* pdata;
 #endif
-        pdata=(float*)(plane.data);
-        const float* idata=(float*)(baseImage.data);
-        float* cdata=data+n;
-        float* hdata=hit+n;
-        //float* ldata=(float*)(newLo.data);
+            pdata=(float*)(plane.data);
+            const float* idata=(float*)(baseImage.data);
+            float* cdata=data+n;
+            float* hdata=hit+n;
+            //float* ldata=(float*)(newLo.data);
 
         
-        float* xdata=(float*)(newHi.data);
-        char*  mdata=(char*)(mask.data);
-        //hdata and cdata aligned
-        //pdata and idata aligned
-        //size_t moff=0;
-        //toc();
-        //tic();
-        for (size_t i=0, moff=0,coff=0,p=0;  i<end; p++, moff+=3, i+=3, coff+=lstep){//.0055 - .0060 s 
-
-            //std::cout<<mdata[moff]<<std::endl;
-            if(mdata[moff]){
-                float v1=fastabs(pdata[i]-idata[i]);
-                float v2=fastabs(pdata[i+1]-idata[i+1]);
-                float v3=fastabs(pdata[i+2]-idata[i+2]);
-                float h=hdata[coff]+1;
-                float ns=cdata[coff]*(1-1/h)+(v1+v2+v3)/h;
+            float* xdata=(float*)(newHi.data);
+            char*  mdata=(char*)(mask.data);
+            //hdata and cdata aligned
+            //pdata and idata aligned
+            //size_t moff=0;
+            for (size_t i=0, moff=0,coff=0,p=0;  i<end; p++, moff+=3, i+=3, coff+=lstep){//.0055 - .0060 s 
+
+                //std::cout<<mdata[moff]<<std::endl;
+                if(mdata[moff]){
+                    float v1=fastabs(pdata[i]-idata[i]);
+                    float v2=fastabs(pdata[i+1]-idata[i+1]);
+                    float v3=fastabs(pdata[i+2]-idata[i+2]);
+                    float h=hdata[coff]+1;
+                    float ns=cdata[coff]*(1-1/h)+(v1+v2+v3)/h;
                 
-                hdata[coff]=h;
-                cdata[coff]=ns;
+                    hdata[coff]=h;
+                    cdata[coff]=ns;
                 
-               // std::cout<<ns<<std::endl;
+                   // std::cout<<ns<<std::endl;
+                }
+#ifdef DTAM_COST_DEBUG
+                {//debug see the cost
+                    pdata[i]=cdata[coff];
+                    pdata[i+1]=cdata[coff];
+                    pdata[i+2]=cdata[coff];
+                }
+#endif
             }
 #ifdef DTAM_COST_DEBUG
-            {//debug see the cost
-                pdata[i]=cdata[coff];
-                pdata[i+1]=cdata[coff];
-                pdata[i+2]=cdata[coff];
+            {//debug
+               pfShow( "Cost Volume Slice", plane,0,cv::Vec2d(0,.5));
+              // gpause();
             }
 #endif
         }
-#ifdef DTAM_COST_DEBUG
-        {//debug
-           pfShow( "Cost Volume Slice", plane,0,cv::Vec2d(0,.5));
-          // gpause();
-        }
-#endif
-        //toc();
-    }
+    },TASK_MAP);
     
 //     cv::Mat loInd(rows,cols,CV_32SC1);
 //     cv::Mat loVal(rows,cols,CV_32FC1);
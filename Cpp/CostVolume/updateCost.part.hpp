@@ -8,7 +8,7 @@
 //debugs
 #include <iostream>
 #include <opencv2/highgui/highgui.hpp>
-#include "../tictoc.h"
+#include "utils/Profiler.hpp"
 
 //in Cost.hpp
 
@@ -7,7 +7,6 @@
 // >>>>>>> 3.0.0
 #include <iostream>
 #include "reproject.hpp"
-#include "tictoc.h"
 
 using namespace cv;
 using namespace std;
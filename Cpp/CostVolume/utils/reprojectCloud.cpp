@@ -5,7 +5,6 @@
 #include "reprojectCloud.hpp"
 
 //debug
-#include "tictoc.h"
 #include "graphics.hpp"
 
 //This reprojects a depthmap and image to another view. Pixels not predicted are set to the color of 0,0
@@ -0,0 +1,273 @@
+#include "OpenDTAM.hpp"
+#include "Scheduler/Placement.hpp"
+#include "graphics.hpp"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <iostream>
+#include <cstdlib>
+
+using namespace cv;
+using namespace std;
+
+OpenDTAM::OpenDTAM(const Mat& _cameraMatrix):
+    layers(32),
+    imagesPerCV(8),
+    keyframeInterval(15),
+    trackBudget(0),
+    maxFrames(256),
+    cameraMatrix(_cameraMatrix.clone()),
+    stopping(),
+    utrkq(8,OVERFLOW_KEEP_LATEST,2),//frames needing tracking, only the freshest are worth tracking
+    trkd(),//frames with good poses
+    ucvq(2,OVERFLOW_DROP_NEWEST,1),//one cost volume at a time, requests while busy are dropped
+    ucvd(4),
+    outq(64,OVERFLOW_DROP_OLDEST),//a caller that stops reading must not stall tracking
+    framePool(),
+    Tutrkid(0),
+    Tucvid(0),
+    fn(0),
+    initd(0),
+    cvPending(0),
+    cvDone(0),
+    tracker(),
+    sinceKeyframe(0)
+    {
+        utrkq.cancelOn(&stopping);
+        trkd.cancelOn(&stopping);
+        ucvq.cancelOn(&stopping);
+        ucvd.cancelOn(&stopping);
+        outq.cancelOn(&stopping);
+    }
+
+OpenDTAM::~OpenDTAM(){
+    if(!initd)
+        return;
+    //both threads share stopping, the first stop wakes them both
+    bool ok=ImplThreadLauncher<OpenDTAM>::stopThread(Tutrkid);
+    ok&=ImplThreadLauncher<OpenDTAM>::stopThread(Tucvid);
+    if(!ok){//a detached stage still runs on the members freed below
+        cerr<<"OpenDTAM: a stage did not stop, aborting rather than freeing the pipeline under it"<<endl;
+        abort();
+    }
+}
+
+void OpenDTAM::init(const Mat& image){
+    CV_Assert(image.type()==CV_32FC3);
+    framePool.create(image.size(),image.type(),16,maxFrames);
+    trkd.setOverflow(OVERFLOW_KEEP_LATEST,imagesPerCV+1);//only a cost volume's worth is ever read back
+    utrkq.readStall();//nothing to track against until the first depth map
+    Tucvid=ImplThreadLauncher<OpenDTAM>::startThread(*this,&OpenDTAM::Tucv,"uCostVolume",-1,&stopping);
+    Tutrkid=ImplThreadLauncher<OpenDTAM>::startThread(*this,&OpenDTAM::Tutrk,"uTrack",-1,&stopping);
+}
+
+void OpenDTAM::setOverflow(const string& queue, OverflowPolicy policy, size_t keep){
+    if(queue=="utrkq")
+        utrkq.setOverflow(policy,keep);
+    else if(queue=="trkd")
+        trkd.setOverflow(policy,keep);
+    else if(queue=="outq")
+        outq.setOverflow(policy,keep);
+    else
+        CV_Error(CV_StsBadArg, "OpenDTAM::setOverflow: unknown queue "+queue);
+}
+
+QueueStats OpenDTAM::queueStats(const string& queue){
+    if(queue=="utrkq")
+        return utrkq.stats();
+    if(queue=="trkd")
+        return trkd.stats();
+    if(queue!="outq")
+        CV_Error(CV_StsBadArg, "OpenDTAM::queueStats: unknown queue "+queue);
+    return outq.stats();
+}
+
+FrameID OpenDTAM::addFrameWithPose(const Mat& image, const Mat& R, const Mat& T){
+    TRACE_SCOPE("addFrameWithPose");
+    if(!initd){
+        init(image);
+        initd=1;
+    }
+    //Increment frame counter
+    FrameID fid = fn++;
+    Trace::flowBegin("frame",fid);
+
+    //Construct new frame
+    Ptr<Frame> newFp=framePool.acquire();
+    newFp->fid=fid;
+    image.copyTo(*newFp->im);
+    R.convertTo(newFp->R,CV_64FC1);
+    T.convertTo(newFp->T,CV_64FC1);
+    newFp->reg3d=1;
+    newFp->gt=1;
+
+    //Add frame to appropriate queues (last because exposes frame to other code)
+    //pushes have side effects, order them properly!
+    trkd.push(newFp);//is tracked
+    outq.push(newFp);
+
+    //A full cost volume's worth of posed frames ends seeding by itself
+    if(fn>=imagesPerCV+1)
+        seedDone();
+    traceQueues();
+    return fid;
+}
+
+void OpenDTAM::seedDone(){
+    if(!cvDone.load())
+        requestCostVolume();
+}
+
+FrameID OpenDTAM::addFrame(const Mat& image){
+    TRACE_SCOPE("addFrame");
+    if(!initd||fn<2){
+        CV_Error(CV_StsAssert, "OpenDTAM not inited properly (Did you add two posed frames yet?) before calling addFrame.");
+    }
+    seedDone();//the first unposed frame ends seeding, if the caller did not
+    //Increment frame counter
+    FrameID fid = fn++;
+    Trace::flowBegin("frame",fid);
+
+    Ptr<Frame> newFp=framePool.acquire();
+    newFp->fid=fid;
+    image.copyTo(*newFp->im);
+
+    utrkq.push(newFp);//needs tracking
+    traceQueues();
+    return fid;
+}
+
+Ptr<Frame> OpenDTAM::popTracked(){
+    TRACE_SCOPE("popTracked");
+    Ptr<Frame> frame=outq.pop();
+    if(!frame.empty())
+        Trace::flowEnd("frame",frame->fid);
+    return frame;
+}
+
+bool OpenDTAM::tryPopTracked(Ptr<Frame>& frame){
+    TRACE_SCOPE("tryPopTracked");
+    if(!outq.tryPop(frame))
+        return false;
+    Trace::flowEnd("frame",frame->fid);
+    return true;
+}
+
+void OpenDTAM::traceQueues(){
+    if(!Trace::enabled())
+        return;
+    Trace::counter("utrkq",utrkq.stats().size);
+    Trace::counter("trkd",trkd.stats().size);
+    Trace::counter("ucvq",ucvq.stats().size);
+    Trace::counter("outq",outq.stats().size);
+}
+
+//Newest tracked frame as the base, the ones before it to fill the volume.
+// At most one is in flight, more would only be stale by the time it ran.
+void OpenDTAM::requestCostVolume(){
+    if(cvPending.load())
+        return;
+    vector<Ptr<Frame> > recent=trkd.newest(imagesPerCV+1);
+    if(recent.size()<2)
+        return;
+    CvJob job;
+    job.first=recent[0];
+    job.second.assign(recent.begin()+1,recent.end());
+    cvPending++;
+    Trace::flowBegin("keyframe",job.first->fid);
+    if(!ucvq.push(job))
+        cvPending--;
+}
+
+bool OpenDTAM::ucv(CvJob& job){
+    TRACE_SCOPE("cost volume");
+    Frame& base=*job.first;
+    Trace::flowStep("keyframe",base.fid);
+    Ptr<Cost> cvp(new Cost(*base.im,layers,cameraMatrix,base.R,base.T));
+    Cost& cv=*cvp;
+    Placement::global().localize("cost",cv.data,sizeof(float)*cv.rows*cv.cols*cv.layers);
+    Placement::global().localize("cost",cv.hit,sizeof(float)*cv.rows*cv.cols*cv.layers);
+    for(size_t i=0;i<job.second.size() && !stopping.stopRequested();i++){
+        Frame& alt=*job.second[i];
+        cv.updateCostL1(*alt.im,alt.R,alt.T);
+    }
+    if(stopping.stopRequested())
+        return false;
+
+    //optimizer iterations are background tasks on the shared pool, this
+    // thread helps with them until the last one has returned
+    cv.optimize();
+    if(!cv.waitOptimizer(&stopping)){
+        cv.stopOptimizer();//cvp must outlive the iterations under way
+        return false;
+    }
+    gpause(&stopping);//with windows open, look at the finished map before tracking gets it
+    base.cv=cvp;
+    base.depth=cv.depthMap().clone();
+    return true;
+}
+
+void OpenDTAM::Tucv(StopToken& stop){
+    Placement::global().apply("cost");//cost volumes are first touched here, so they land on its node
+    CvJob job;
+    while(ucvq.pop(job)){
+        if(ucv(job)){
+            ucvd.push(job.first);
+            cvDone++;
+            utrkq.readUnstall();//there is a depth map to track against now
+        }
+        cvPending--;
+        traceQueues();
+        job=CvJob();//don't hold the frames while idle
+    }
+}
+
+bool OpenDTAM::utrk(Frame& frame){
+    //pick up finished depth maps
+    Ptr<Frame> kf;
+    while(ucvd.tryPop(kf)){
+        Trace::flowEnd("keyframe",kf->fid);
+        if(tracker.empty()){
+            tracker=new Track(*kf->im,kf->depth,cameraMatrix,kf->R,kf->T);
+            Ptr<Frame> lf=trkd.newest(1)[0];//start from the newest good pose, kf is in trkd so there is one
+            Mat p;
+            RTToLie(lf->R,lf->T,p);
+            tracker->setPose(p);
+        }
+        tracker->addKeyframe(*kf->im,kf->depth,kf->R,kf->T);
+        sinceKeyframe=0;
+    }
+
+    Track& track=*tracker;
+    track.addFrame(*frame.im);
+    if(trackBudget>0)
+        track.align(trackBudget);
+    else
+        track.align();
+    frame.track=track.diagnostics;
+    if(track.diagnostics.failed)
+        return false;
+    LieToRT(track.pose,frame.R,frame.T);
+    frame.reg3d=1;
+    return true;
+}
+
+void OpenDTAM::Tutrk(StopToken& stop){
+    Placement::global().apply("track");
+    Ptr<Frame> myFrame;
+    while(utrkq.pop(myFrame)){
+        TRACE_SCOPE("track frame");
+        Trace::flowStep("frame",myFrame->fid);
+        if(utrk(*myFrame)){
+            trkd.push(myFrame);
+            sinceKeyframe++;
+        }else{
+            cout<<"OpenDTAM: tracking lost on frame "<<myFrame->fid<<", rebuilding the map"<<endl;
+            sinceKeyframe=keyframeInterval;
+        }
+        outq.push(myFrame);
+        bool due=sinceKeyframe>=keyframeInterval || myFrame->track.weak();
+        if(due && !stop.stopRequested())//no new maps while draining
+            requestCostVolume();
+        traceQueues();
+        myFrame.release();//don't hold the frame while idle
+    }
+}
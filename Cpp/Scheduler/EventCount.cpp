@@ -0,0 +1,53 @@
+#include "EventCount.hpp"
+
+#if defined __linux__
+    #include <unistd.h>
+    #include <limits.h>
+    #include <sys/syscall.h>
+    #include <linux/futex.h>
+
+    struct EventCount::Impl{};
+
+    void EventCount::init() { impl = NULL; }
+    void EventCount::destroy() { }
+
+    void EventCount::sleep(unsigned key)
+    {
+        //returns at once if the epoch moved on since key was taken, spurious wakes are fine
+        syscall(SYS_futex,(int*)&epoch,FUTEX_WAIT_PRIVATE,(int)key,NULL,NULL,0);
+    }
+    void EventCount::wake(bool all)
+    {
+        syscall(SYS_futex,(int*)&epoch,FUTEX_WAKE_PRIVATE,all?INT_MAX:1,NULL,NULL,0);
+    }
+#else
+    #include "ImplMutex.hpp"
+
+    struct EventCount::Impl{
+        ImplMutex mutex;
+        ImplCondVar cond;
+    };
+
+    void EventCount::init() { impl = new Impl; }
+    void EventCount::destroy()
+    {
+        delete impl;
+        impl = NULL;
+    }
+
+    void EventCount::sleep(unsigned key)
+    {
+        ScopeLock s(impl->mutex);
+        while(epoch.load()==key){
+            impl->cond.wait(impl->mutex);
+        }
+    }
+    void EventCount::wake(bool all)
+    {
+        ScopeLock s(impl->mutex);
+        if(all)
+            impl->cond.broadcast();
+        else
+            impl->cond.signal();
+    }
+#endif
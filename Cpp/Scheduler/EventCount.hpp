@@ -0,0 +1,59 @@
+#ifndef EVENT_COUNT_HPP
+#define EVENT_COUNT_HPP
+//Eventcount: lets lock-free structures block only when they have to.
+// A waiter announces itself, takes a key, rechecks its condition and only
+// then sleeps on the key. A notifier that finds no one announced costs a
+// fence and a load, so the uncontended push/pop never enter the kernel.
+//
+// waiter:                              notifier:
+//   key=ec.prepareWait();                publish the item
+//   if(condition) ec.cancelWait();       ec.notifyOne();
+//   else ec.wait(key);
+//
+// Linux sleeps on a futex, elsewhere on an ImplMutex/ImplCondVar pair.
+#include <atomic>
+
+class EventCount{
+public:
+    EventCount():epoch(0),waiters(0) { init(); }
+    ~EventCount() { destroy(); }
+
+    unsigned prepareWait(){
+        waiters.fetch_add(1,std::memory_order_seq_cst);
+        return epoch.load(std::memory_order_seq_cst);
+    }
+    void cancelWait(){
+        waiters.fetch_sub(1,std::memory_order_relaxed);
+    }
+    void wait(unsigned key){
+        sleep(key);
+        waiters.fetch_sub(1,std::memory_order_relaxed);
+    }
+    void notifyOne(){ notify(false); }
+    void notifyAll(){ notify(true); }
+
+    struct Impl;
+protected:
+    Impl* impl;
+
+private:
+    void notify(bool all){
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiters.load(std::memory_order_relaxed)==0)
+            return;
+        epoch.fetch_add(1,std::memory_order_seq_cst);
+        wake(all);
+    }
+    void init();
+    void destroy();
+    void sleep(unsigned key);
+    void wake(bool all);
+
+    std::atomic<unsigned> epoch;//the futex word
+    std::atomic<int> waiters;
+
+    EventCount(const EventCount&);
+    EventCount& operator = (const EventCount& m);
+};
+
+#endif
@@ -1,31 +1,29 @@
 #ifndef FRAME_HPP
 #define FRAME_HPP
+#include <opencv2/core/core.hpp>
+#include <string.h>
+#include "CostVolume/Cost.h"
+#include "Track/Diagnostics.hpp"
+
+typedef int FrameID;
 
 struct Frame{
     //All info associated with a frame
-    //Data that can be discarded eventually 
+    //Data that can be discarded eventually
     FrameID fid;
-    Ptr<Mat> im;
-    Ptr<Mat> gray;
-    Mat R;
-    Mat T;
-    
-    Mat relPose2d;
-    Mat relPose3d;
-    
-//     //Ptr<Mat> CameraMatrix;
-    int reg2d;//2d registered?
-    int reg3d;//3d registered
+    cv::Ptr<cv::Mat> im;//CV_32FC3, as the cost volume wants it
+    cv::Mat R;
+    cv::Mat T;
+
+    int reg3d;//3d registered (R,T are valid)
     int gt;//ground truth
-//     Mat pose;//the global pose
-    Ptr<Frame> parent;//the frame whose cv was used for registration
-//     vector<Ptr<CostVolume>> consumers;//the cost volumes using this image as inputs (non-base)
-    Ptr<CostVolume> cv;// the cost volume(if any) that uses this image as the base image
-    Ptr<DepthmapDenoiseWeightedHuber> optimizer;
-//     Tracker tracker;
-//     vector<Mat> pyramid;
-    Ptr<vector<Mat> > pyramid;
-    Frame():fid(0),im(),gray(),R(),T(),relPose2d(),relPose3d(),reg2d(0),reg3d(0),gt(0),parent(),cv(),optimizer(),pyramid(){}
+    TrackDiagnostics track;//how the tracking went, if it was tracked
+    cv::Ptr<Frame> parent;//the frame whose depth map was used for registration
+    cv::Ptr<Cost> cv;// the cost volume(if any) that uses this image as the base image
+    cv::Mat depth;//inverse depth from cv, once it is optimized
+    Frame():fid(0),im(),R(),T(),reg3d(0),gt(0),parent(),cv(),depth(){
+        memset(&track,0,sizeof(track));
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
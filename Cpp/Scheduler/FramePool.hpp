@@ -0,0 +1,97 @@
+#ifndef FRAME_POOL_HPP
+#define FRAME_POOL_HPP
+//Recycles Frames and their image buffers, so once the pipeline has reached
+// its working set a new frame costs a memcpy, not a malloc and page faults.
+//
+// The pool keeps a reference to every Frame it made. A Frame is free again
+// when the pool holds the only reference to it AND to its image data (Track
+// and Cost keep Mat headers onto the image of frames they use).
+// It grows up to a limit; past it acquire() fails loudly, as a working set
+// that large means frames are leaking, usually a caller holding every one
+// it popped.
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "ImplMutex.hpp"
+#include "Frame.hpp"
+
+class FramePool{
+public:
+    FramePool():type(CV_32FC3),next(0),limit(0){}
+
+    //Drops free frames of another size, preallocates count frames.
+    // _limit caps the frames made, 0 for no cap.
+    void create(cv::Size _size,int _type,int count=16,int _limit=0){
+        ScopeLock s(mutex);
+        size=_size;
+        type=_type;
+        limit=_limit;
+        frames.clear();
+        frames.reserve(count*4);
+        for(int i=0;i<count;i++)
+            frames.push_back(make());
+        next=0;
+    }
+
+    //A reset Frame with im allocated at the pool's size and type,
+    // R and T 3x3 and 3x1 CV_64F. Allocates only if every frame is in use,
+    // throws a cv::Exception if that would pass the limit.
+    cv::Ptr<Frame> acquire(){
+        ScopeLock s(mutex);
+        size_t n=frames.size();
+        for(size_t i=0;i<n;i++){
+            size_t k=(next+i)%n;
+            if(reclaim(frames[k])){
+                next=(k+1)%n;
+                reset(*frames[k]);
+                return frames[k];
+            }
+        }
+        if(limit && (int)n>=limit)
+            CV_Error(CV_StsNoMem, cv::format("FramePool: all %d frames are in use, release the frames you popped or raise the limit",limit));
+        frames.push_back(make());
+        return frames.back();
+    }
+
+    int allocated(){//frames made so far, stops growing at the working set
+        ScopeLock s(mutex);
+        return frames.size();
+    }
+
+private:
+    bool reclaim(const cv::Ptr<Frame>& f){
+        if(f.use_count()!=1)
+            return false;
+        //no one else can reach f, so its own references can go: a keyframe's
+        // Cost holds its image too
+        f->cv.release();
+        f->parent.release();
+        const cv::Mat& im=*f->im;
+        return !im.u || im.u->refcount==1;
+    }
+    cv::Ptr<Frame> make(){
+        cv::Ptr<Frame> f(new Frame);
+        f->im=new cv::Mat(size,type);
+        f->R.create(3,3,CV_64FC1);
+        f->T.create(3,1,CV_64FC1);
+        return f;
+    }
+    void reset(Frame& f){//keeps the buffers
+        f.fid=0;
+        f.reg3d=0;
+        f.gt=0;
+        memset(&f.track,0,sizeof(f.track));
+        f.parent.release();
+        f.cv.release();
+        f.depth.release();
+        f.im->create(size,type);
+    }
+
+    ImplMutex mutex;
+    std::vector<cv::Ptr<Frame> > frames;
+    cv::Size size;
+    int type;
+    size_t next;//where the next search starts, so frames are reused round robin
+    int limit;//most frames ever made, 0 for no limit
+};
+
+#endif
@@ -73,6 +73,125 @@
         int refcount;
     };
 */
+#elif defined IMPL_MUTEX_FUTEX
+    #include <unistd.h>
+    #include <limits.h>
+    #include <sys/syscall.h>
+    #include <linux/futex.h>
+
+    #define IMPL_MUTEX_MAX_SPIN 1000
+
+    static inline void futexWait(std::atomic<int>* w,int val){
+        syscall(SYS_futex,(int*)w,FUTEX_WAIT_PRIVATE,val,NULL,NULL,0);
+    }
+    static inline void futexWake(std::atomic<int>* w,int n){
+        syscall(SYS_futex,(int*)w,FUTEX_WAKE_PRIVATE,n,NULL,NULL,0);
+    }
+    static inline void cpuRelax(){
+    #if defined __i386__ || defined __x86_64__
+        __builtin_ia32_pause();
+    #elif defined __aarch64__
+        asm volatile("yield");
+    #endif
+    }
+
+    #ifdef IMPL_MUTEX_STATS
+        #include <time.h>
+        //what the acquiring thread went through, folded in once it holds the lock
+        static __thread uint64_t tlsSpins;
+        static __thread int tlsWaits;
+        static __thread bool tlsContended;
+        static uint64_t nowNs(){
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC,&ts);
+            return (uint64_t)ts.tv_sec*1000000000ull+ts.tv_nsec;
+        }
+        #define STAT(x) x
+    #else
+        #define STAT(x)
+    #endif
+
+    void ImplMutex::init()
+    {
+        word=0;
+        spinEstimate=0;
+    #ifdef IMPL_MUTEX_STATS
+        resetStats();
+    #endif
+    }
+    void ImplMutex::destroy() { }
+
+    //Spin for up to twice what recent acquisitions needed (glibc's adaptive
+    // mutex rule), then park.
+    void ImplMutex::lockSlow()
+    {
+        STAT(tlsContended=true;)
+        int est=spinEstimate.load(std::memory_order_relaxed);
+        int limit=est/4+10;//2*est/8
+        if(limit>IMPL_MUTEX_MAX_SPIN)
+            limit=IMPL_MUTEX_MAX_SPIN;
+        for(int i=0;i<limit;i++){
+            cpuRelax();
+            int c=0;
+            if(word.load(std::memory_order_relaxed)==0 &&
+               word.compare_exchange_weak(c,1,std::memory_order_acquire)){
+                spinEstimate.fetch_add(i-est/8,std::memory_order_relaxed);//est+=(i*8-est)/8
+                STAT(tlsSpins+=i+1;)
+                return;
+            }
+        }
+        spinEstimate.fetch_add(limit-est/8,std::memory_order_relaxed);
+        STAT(tlsSpins+=limit;)
+        lockParked();
+    }
+    void ImplMutex::lockParked()
+    {
+        //state 2 from here on: whoever unlocks must wake someone
+        while(word.exchange(2,std::memory_order_acquire)!=0){
+            STAT(tlsWaits++;)
+            futexWait(&word,2);
+        }
+    }
+    void ImplMutex::unlockSlow()
+    {
+        word.store(0,std::memory_order_release);
+        futexWake(&word,1);
+    }
+
+    #ifdef IMPL_MUTEX_STATS
+        void ImplMutex::held()
+        {
+            counts.locks++;
+            counts.contended+=tlsContended;
+            counts.waits+=tlsWaits;
+            counts.spins+=tlsSpins;
+            tlsContended=false;
+            tlsWaits=0;
+            tlsSpins=0;
+            lockedAt=nowNs();
+        }
+        void ImplMutex::released()
+        {
+            uint64_t t=nowNs()-lockedAt;
+            counts.holdNs+=t;
+            if(t>counts.maxHoldNs)
+                counts.maxHoldNs=t;
+        }
+        ImplMutexStats ImplMutex::stats()
+        {
+            lock();
+            ImplMutexStats s=counts;
+            s.locks--;//not this one
+            unlock();
+            return s;
+        }
+        void ImplMutex::resetStats()
+        {
+            counts.locks=counts.contended=counts.waits=counts.spins=0;
+            counts.holdNs=counts.maxHoldNs=0;
+            lockedAt=0;
+        }
+    #endif
 #else
 
     struct ImplMutex::Impl
@@ -93,6 +212,7 @@
 
 #endif
 
+#ifndef IMPL_MUTEX_FUTEX
 void ImplMutex::init()
 {
     impl = new Impl;
@@ -107,6 +227,7 @@ void ImplMutex::destroy()
 void ImplMutex::lock() { impl->lock(); }
 void ImplMutex::unlock() { impl->unlock(); }
 bool ImplMutex::trylock() { return impl->trylock(); }
+#endif
 
 
 
@@ -178,6 +299,29 @@ bool ImplMutex::trylock() { return impl->trylock(); }
         if (have_waiters)
             SetEvent (cv->events_[SIGNAL]);
     }
+#elif defined IMPL_MUTEX_FUTEX
+    void ImplCondVar::init() { seq=0; }
+    void ImplCondVar::destroy() { }
+
+    //A signal between the unlock and the futex wait changes seq, so the wait returns at once
+    void ImplCondVar::wait(ImplMutex& mutex)
+    {
+        unsigned s=seq.load(std::memory_order_relaxed);
+        mutex.unlock();
+        syscall(SYS_futex,(int*)&seq,FUTEX_WAIT_PRIVATE,(int)s,NULL,NULL,0);
+        mutex.lockParked();//others may be parked behind us, keep the word at 2
+        mutex.held();
+    }
+    void ImplCondVar::signal()
+    {
+        seq.fetch_add(1,std::memory_order_release);
+        syscall(SYS_futex,(int*)&seq,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
+    }
+    void ImplCondVar::broadcast()
+    {
+        seq.fetch_add(1,std::memory_order_release);
+        syscall(SYS_futex,(int*)&seq,FUTEX_WAKE_PRIVATE,INT_MAX,NULL,NULL,0);
+    }
 #else
     struct ImplCondVar::Impl{
         void init() { pthread_cond_init(&c, 0); refcount = 1; }
@@ -193,6 +337,7 @@ bool ImplMutex::trylock() { return impl->trylock(); }
 #endif
 
 
+#ifndef IMPL_MUTEX_FUTEX
 void ImplCondVar::init()
 {
     impl = new Impl;
@@ -207,4 +352,5 @@ void ImplCondVar::destroy()
 void ImplCondVar::signal(){impl->signal();}
 void ImplCondVar::broadcast(){impl->broadcast();}
 void ImplCondVar::wait(ImplMutex& mutex){impl->wait(mutex);}
+#endif
 
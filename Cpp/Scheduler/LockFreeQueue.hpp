@@ -0,0 +1,380 @@
+#ifndef LOCK_FREE_QUEUE_HPP
+#define LOCK_FREE_QUEUE_HPP
+//Bounded lock-free FIFOs for the frame pipeline: push/pop/readStall/
+// readUnstall plus non-blocking try versions and, single consumer only, peek.
+//
+// SPSCQueue: one producer thread, one consumer thread, for stage to stage
+//            hops (OpenDTAM's ucvd, mapping to tracking).
+// MPMCQueue: any number of each, for worker pools (Vyukov's bounded queue).
+//            Takes an OverflowPolicy, since a producer may evict from it.
+//
+// Neither takes a lock. A consumer only sleeps (on an EventCount) when the
+// queue is empty or read stalled, a producer only when it is full.
+// Capacity is rounded up to a power of two. Popped slots are reset to T()
+// so a Ptr<Frame> is released when it leaves, not when it is overwritten.
+// cancelOn(&token) makes the blocking calls stop and drain (StopToken.hpp).
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "EventCount.hpp"
+#include "QueuePolicy.hpp"
+#include "StopToken.hpp"
+
+#define LFQ_CACHE_LINE 64
+#define LFQ_EVICT_TRIES 8//DROP_OLDEST pushes give up after this many evictions
+
+static inline size_t lfqCapacity(size_t n){
+    size_t c=2;
+    while(c<n)
+        c<<=1;
+    return c;
+}
+
+template <class T>
+class SPSCQueue{
+public:
+    explicit SPSCQueue(size_t capacity=64){
+        mask=lfqCapacity(capacity)-1;
+        buf=new T[mask+1];
+        head=tail=0;
+        headCache=tailCache=0;
+        _readStall=0;
+    }
+    ~SPSCQueue(){
+        delete [] buf;
+    }
+
+    void cancelOn(StopToken* token){
+        stop.set(token,[this](){
+            notEmpty.notifyAll();
+            notFull.notifyAll();
+        });
+    }
+
+    //producer side
+    bool tryPush(const T& in){
+        size_t t=tail.load(std::memory_order_relaxed);
+        if(t-headCache>mask){
+            headCache=head.load(std::memory_order_acquire);
+            if(t-headCache>mask)
+                return false;//full
+        }
+        buf[t&mask]=in;
+        tail.store(t+1,std::memory_order_release);
+        notEmpty.notifyOne();
+        return true;
+    }
+    bool push(const T& in){//false only if stopped while full
+        while(!tryPush(in)){
+            unsigned key=notFull.prepareWait();
+            if(tryPush(in)){
+                notFull.cancelWait();
+                return true;
+            }
+            if(stop.stopped()){
+                notFull.cancelWait();
+                return false;
+            }
+            notFull.wait(key);
+        }
+        return true;
+    }
+
+    //consumer side
+    bool tryPop(T& out){
+        size_t h;
+        if(!front(h))
+            return false;
+        out=buf[h&mask];
+        buf[h&mask]=T();
+        head.store(h+1,std::memory_order_release);
+        notFull.notifyOne();
+        return true;
+    }
+    bool pop(T& out){//false once stopped and drained
+        return waitFor(&SPSCQueue::tryPop,out);
+    }
+    T pop(){
+        T out;
+        waitFor(&SPSCQueue::tryPop,out);
+        return out;
+    }
+    bool tryPeek(T& out){//the next element, left in the queue
+        size_t h;
+        if(!front(h))
+            return false;
+        out=buf[h&mask];
+        return true;
+    }
+    T peek(){//T() once stopped and drained
+        T out;
+        waitFor(&SPSCQueue::tryPeek,out);
+        return out;
+    }
+
+    void readStall(){
+        _readStall.store(1,std::memory_order_release);
+    }
+    void readUnstall(){
+        _readStall.store(0,std::memory_order_release);
+        notEmpty.notifyAll();
+    }
+    size_t size() const{//approximate unless called from one of the two threads
+        return tail.load(std::memory_order_acquire)-head.load(std::memory_order_acquire);
+    }
+    size_t capacity() const{
+        return mask+1;
+    }
+
+private:
+    bool front(size_t& h){
+        if(_readStall.load(std::memory_order_acquire))
+            return false;
+        h=head.load(std::memory_order_relaxed);
+        if(h==tailCache){
+            tailCache=tail.load(std::memory_order_acquire);
+            if(h==tailCache)
+                return false;//empty
+        }
+        return true;
+    }
+    bool waitFor(bool (SPSCQueue::*attempt)(T&),T& out){
+        while(!(this->*attempt)(out)){
+            unsigned key=notEmpty.prepareWait();
+            if((this->*attempt)(out)){
+                notEmpty.cancelWait();
+                return true;
+            }
+            if(stop.stopped()){
+                notEmpty.cancelWait();
+                return false;
+            }
+            notEmpty.wait(key);
+        }
+        return true;
+    }
+
+    T* buf;
+    size_t mask;
+    char pad0[LFQ_CACHE_LINE];
+    std::atomic<size_t> head;//consumer owned
+    size_t tailCache;        //consumer's last view of tail
+    char pad1[LFQ_CACHE_LINE];
+    std::atomic<size_t> tail;//producer owned
+    size_t headCache;        //producer's last view of head
+    char pad2[LFQ_CACHE_LINE];
+    std::atomic<int> _readStall;
+    EventCount notEmpty;
+    EventCount notFull;
+    StopLink stop;
+
+    SPSCQueue(const SPSCQueue&);
+    SPSCQueue& operator = (const SPSCQueue&);
+};
+
+template <class T>
+class MPMCQueue{
+public:
+    explicit MPMCQueue(size_t capacity=64,OverflowPolicy policy=OVERFLOW_BLOCK,size_t keep=0){
+        mask=lfqCapacity(capacity)-1;
+        cells=new Cell[mask+1];
+        for(size_t i=0;i<=mask;i++)
+            cells[i].seq.store(i,std::memory_order_relaxed);
+        enqueuePos=dequeuePos=0;
+        _readStall=0;
+        pushed=dropped=peak=0;
+        setOverflow(policy,keep);
+    }
+    ~MPMCQueue(){
+        delete [] cells;
+    }
+
+    void cancelOn(StopToken* token){
+        stop.set(token,[this](){
+            notEmpty.notifyAll();
+            notFull.notifyAll();
+        });
+    }
+
+    //keep caps the queue below its capacity, 0 means the full ring.
+    // Safe while the queue is in use, pushes already under way finish
+    // under the old setting.
+    void setOverflow(OverflowPolicy p,size_t keep=0){
+        limit.store((keep>0 && keep<=mask) ? keep : mask+1,std::memory_order_relaxed);
+        policy.store(p,std::memory_order_relaxed);
+    }
+
+    bool tryPush(const T& in){
+        Cell* c;
+        size_t pos=enqueuePos.load(std::memory_order_relaxed);
+        for(;;){
+            c=&cells[pos&mask];
+            size_t seq=c->seq.load(std::memory_order_acquire);
+            intptr_t dif=(intptr_t)seq-(intptr_t)pos;
+            if(dif==0){
+                //dequeuePos only grows, so if pos is still free when the
+                // CAS claims it the queue holds at most used elements
+                intptr_t used=(intptr_t)(pos-dequeuePos.load(std::memory_order_acquire));
+                if(used<0){//pos is stale, consumers are past it
+                    pos=enqueuePos.load(std::memory_order_relaxed);
+                    continue;
+                }
+                if((size_t)used>=limit.load(std::memory_order_relaxed))
+                    return false;//at the limit
+                if(enqueuePos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+                    break;
+            }else if(dif<0){
+                return false;//full
+            }else{
+                pos=enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        c->data=in;
+        c->seq.store(pos+1,std::memory_order_release);
+        notEmpty.notifyOne();
+        counted();
+        return true;
+    }
+    //Applies the overflow policy, false if in was dropped (or stopped while blocked)
+    bool push(const T& in){
+        OverflowPolicy policy=this->policy.load(std::memory_order_relaxed);
+        if(policy==OVERFLOW_DROP_NEWEST){
+            if(tryPush(in))
+                return true;
+            dropped.fetch_add(1,std::memory_order_relaxed);
+            return false;
+        }
+        if(policy==OVERFLOW_DROP_OLDEST){
+            //other producers may refill each slot evicted, so in is
+            // dropped instead once the tries are used up
+            for(int tries=0;!tryPush(in);tries++){
+                if(tries==LFQ_EVICT_TRIES){
+                    dropped.fetch_add(1,std::memory_order_relaxed);
+                    return false;
+                }
+                T old;
+                if(dequeue(old))//evicts even while read stalled, the stall is for consumers
+                    dropped.fetch_add(1,std::memory_order_relaxed);
+            }
+            return true;
+        }
+        while(!tryPush(in)){
+            unsigned key=notFull.prepareWait();
+            if(tryPush(in)){
+                notFull.cancelWait();
+                return true;
+            }
+            if(stop.stopped()){
+                notFull.cancelWait();
+                return false;
+            }
+            notFull.wait(key);
+        }
+        return true;
+    }
+
+    bool tryPop(T& out){
+        if(_readStall.load(std::memory_order_acquire))
+            return false;
+        return dequeue(out);
+    }
+    bool pop(T& out){//false once stopped and drained
+        while(!tryPop(out)){
+            unsigned key=notEmpty.prepareWait();
+            if(tryPop(out)){
+                notEmpty.cancelWait();
+                return true;
+            }
+            if(stop.stopped()){
+                notEmpty.cancelWait();
+                return false;
+            }
+            notEmpty.wait(key);
+        }
+        return true;
+    }
+    T pop(){
+        T out;
+        pop(out);
+        return out;
+    }
+
+    void readStall(){
+        _readStall.store(1,std::memory_order_release);
+    }
+    void readUnstall(){
+        _readStall.store(0,std::memory_order_release);
+        notEmpty.notifyAll();
+    }
+    size_t size() const{//approximate
+        size_t e=enqueuePos.load(std::memory_order_acquire);
+        size_t d=dequeuePos.load(std::memory_order_acquire);
+        return e>d ? e-d : 0;
+    }
+    size_t capacity() const{
+        return mask+1;
+    }
+    QueueStats stats() const{
+        QueueStats s;
+        s.size=size();
+        s.limit=limit.load(std::memory_order_relaxed);
+        s.peak=peak.load(std::memory_order_relaxed);
+        s.pushed=pushed.load(std::memory_order_relaxed);
+        s.dropped=dropped.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    bool dequeue(T& out){
+        Cell* c;
+        size_t pos=dequeuePos.load(std::memory_order_relaxed);
+        for(;;){
+            c=&cells[pos&mask];
+            size_t seq=c->seq.load(std::memory_order_acquire);
+            intptr_t dif=(intptr_t)seq-(intptr_t)(pos+1);
+            if(dif==0){
+                if(dequeuePos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+                    break;
+            }else if(dif<0){
+                return false;//empty
+            }else{
+                pos=dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        out=c->data;
+        c->data=T();
+        c->seq.store(pos+mask+1,std::memory_order_release);
+        notFull.notifyOne();
+        return true;
+    }
+    void counted(){
+        pushed.fetch_add(1,std::memory_order_relaxed);
+        size_t s=size();
+        size_t p=peak.load(std::memory_order_relaxed);
+        while(s>p && !peak.compare_exchange_weak(p,s,std::memory_order_relaxed));
+    }
+
+    struct Cell{
+        std::atomic<size_t> seq;
+        T data;
+    };
+    Cell* cells;
+    size_t mask;
+    std::atomic<OverflowPolicy> policy;
+    std::atomic<size_t> limit;
+    char pad0[LFQ_CACHE_LINE];
+    std::atomic<size_t> enqueuePos;
+    char pad1[LFQ_CACHE_LINE];
+    std::atomic<size_t> dequeuePos;
+    char pad2[LFQ_CACHE_LINE];
+    std::atomic<int> _readStall;
+    std::atomic<size_t> pushed,dropped,peak;
+    EventCount notEmpty;
+    EventCount notFull;
+    StopLink stop;
+
+    MPMCQueue(const MPMCQueue&);
+    MPMCQueue& operator = (const MPMCQueue&);
+};
+
+#endif
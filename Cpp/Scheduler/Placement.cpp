@@ -0,0 +1,275 @@
+#include "Placement.hpp"
+#include <sched.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+
+//mbind(2) without libnuma
+#define PLACEMENT_MPOL_BIND 2
+#define PLACEMENT_MPOL_MF_MOVE 2
+
+static bool readInt(const string& path,int& v){
+    FILE* f=fopen(path.c_str(),"r");
+    if(!f)
+        return false;
+    bool ok=fscanf(f,"%d",&v)==1;
+    fclose(f);
+    return ok;
+}
+
+//"0-3,8,10-11"
+static bool parseList(const string& s,vector<int>& out){
+    stringstream ss(s);
+    string item;
+    while(getline(ss,item,',')){
+        if(item.empty())
+            continue;
+        int a,b;
+        if(sscanf(item.c_str(),"%d-%d",&a,&b)==2){
+            if(b<a)
+                return false;
+            for(int i=a;i<=b;i++)
+                out.push_back(i);
+        }else if(sscanf(item.c_str(),"%d",&a)==1){
+            out.push_back(a);
+        }else{
+            return false;
+        }
+    }
+    return true;
+}
+
+Placement::Placement(){
+    readTopology();
+    defaults();
+}
+
+static Placement* loadGlobal(){
+    Placement* p=new Placement;
+    const char* file=getenv("DTAM_PLACEMENT");
+    if(file)
+        p->load(file);
+    return p;
+}
+Placement& Placement::global(){
+    static Placement* p=loadGlobal();
+    return *p;
+}
+
+void Placement::readTopology(){
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if(sched_getaffinity(0,sizeof(mask),&mask)==0){
+        for(int c=0;c<CPU_SETSIZE;c++){
+            if(CPU_ISSET(c,&mask))
+                allowed.push_back(c);
+        }
+    }
+    if(allowed.empty())
+        allowed.push_back(0);
+
+    //node of each CPU, from the node directories, absent without NUMA
+    map<int,int> nodeOf;
+    DIR* nodes=opendir("/sys/devices/system/node");
+    if(nodes){
+        while(dirent* e=readdir(nodes)){
+            int n;
+            char tail;
+            if(sscanf(e->d_name,"node%d%c",&n,&tail)!=1)
+                continue;
+            ifstream in(string("/sys/devices/system/node/")+e->d_name+"/cpulist");
+            string list;
+            vector<int> c;
+            if(getline(in,list) && parseList(list,c)){
+                for(size_t i=0;i<c.size();i++)
+                    nodeOf[c[i]]=n;
+            }
+        }
+        closedir(nodes);
+    }
+
+    map<pair<int,int>,int> coreIndex;//(package,core_id) -> index in coreCpus
+    for(size_t i=0;i<allowed.size();i++){
+        int c=allowed[i];
+        char dir[96];
+        snprintf(dir,sizeof(dir),"/sys/devices/system/cpu/cpu%d/",c);
+        int pkg=0,core=c;
+        readInt(string(dir)+"topology/physical_package_id",pkg);
+        readInt(string(dir)+"topology/core_id",core);
+        pair<int,int> key(pkg,core);
+        if(!coreIndex.count(key)){
+            coreIndex[key]=coreCpus.size();
+            coreCpus.push_back(vector<int>());
+        }
+        coreCpus[coreIndex[key]].push_back(c);
+
+        map<int,int>::const_iterator it=nodeOf.find(c);
+        int node=it==nodeOf.end()?0:it->second;
+        cpuNode[c]=node;
+        nodeCpus[node].push_back(c);
+    }
+}
+
+//Tracking keeps one core to itself when there are enough, everything else shares the rest.
+void Placement::defaults(){
+    stages.clear();
+    stages["default"]=allowed;
+    if(coreCpus.size()>=3){
+        stages["track"]=vector<int>(1,coreCpus[0][0]);
+        vector<int> rest;
+        for(size_t k=1;k<coreCpus.size();k++)
+            rest.insert(rest.end(),coreCpus[k].begin(),coreCpus[k].end());
+        stages["optimizer"]=rest;
+        stages["cost"]=rest;
+    }
+}
+
+string Placement::canonical(const string& stage){
+    if(stage=="qd"||stage=="a"||stage=="QD"||stage=="A")
+        return "optimizer";
+    return stage;
+}
+
+bool Placement::set(const string& _stage,const string& spec){
+    string stage=canonical(_stage);
+    stringstream ss(spec);
+    string kind,list;
+    ss>>kind;
+    getline(ss,list);
+    list.erase(remove(list.begin(),list.end(),' '),list.end());
+
+    vector<int> idx,out;
+    if(kind!="any" && (!parseList(list,idx) || idx.empty())){
+        cerr<<"Placement: bad list for "<<stage<<": \""<<spec<<"\""<<endl;
+        return false;
+    }
+    if(kind=="any"){
+        out=allowed;
+    }else if(kind=="cpu"){
+        for(size_t i=0;i<idx.size();i++){
+            if(cpuNode.count(idx[i]))
+                out.push_back(idx[i]);
+        }
+    }else if(kind=="core"||kind=="thread"){
+        for(size_t i=0;i<idx.size();i++){
+            if(idx[i]<0||idx[i]>=(int)coreCpus.size())
+                continue;
+            const vector<int>& siblings=coreCpus[idx[i]];
+            if(kind=="thread")
+                out.push_back(siblings[0]);
+            else
+                out.insert(out.end(),siblings.begin(),siblings.end());
+        }
+    }else if(kind=="node"){
+        vector<int> nodes;//allowed nodes in order
+        for(map<int,vector<int> >::const_iterator it=nodeCpus.begin();it!=nodeCpus.end();it++)
+            nodes.push_back(it->first);
+        for(size_t i=0;i<idx.size();i++){
+            if(idx[i]<0||idx[i]>=(int)nodes.size())
+                continue;
+            const vector<int>& c=nodeCpus[nodes[idx[i]]];
+            out.insert(out.end(),c.begin(),c.end());
+        }
+    }else{
+        cerr<<"Placement: unknown kind \""<<kind<<"\" for "<<stage<<endl;
+        return false;
+    }
+    if(out.empty()){
+        cerr<<"Placement: "<<stage<<" \""<<spec<<"\" names no CPU this process may use, leaving it unpinned"<<endl;
+        out=allowed;
+    }
+    sort(out.begin(),out.end());
+    out.erase(unique(out.begin(),out.end()),out.end());
+    stages[stage]=out;
+    return true;
+}
+
+bool Placement::load(const string& file){
+    ifstream in(file.c_str());
+    if(!in){
+        cerr<<"Placement: cannot read "<<file<<endl;
+        return false;
+    }
+    bool ok=true;
+    string line;
+    while(getline(in,line)){
+        size_t hash=line.find('#');
+        if(hash!=string::npos)
+            line.erase(hash);
+        stringstream ss(line);
+        string stage,spec;
+        if(!(ss>>stage))
+            continue;
+        getline(ss,spec);
+        ok&=set(stage,spec);
+    }
+    return ok;
+}
+
+const vector<int>& Placement::cpus(const string& stage) const{
+    map<string,vector<int> >::const_iterator it=stages.find(canonical(stage));
+    if(it==stages.end())
+        it=stages.find("default");
+    return it->second;
+}
+
+int Placement::node(const string& stage) const{
+    const vector<int>& c=cpus(stage);
+    int n=-1;
+    for(size_t i=0;i<c.size();i++){
+        map<int,int>::const_iterator it=cpuNode.find(c[i]);
+        int ni=it==cpuNode.end()?0:it->second;
+        if(n>=0 && ni!=n)
+            return -1;
+        n=ni;
+    }
+    return n;
+}
+
+bool Placement::apply(const string& stage,pthread_t thread) const{
+    const vector<int>& c=cpus(stage);
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for(size_t i=0;i<c.size();i++)
+        CPU_SET(c[i],&mask);
+    return pthread_setaffinity_np(thread,sizeof(mask),&mask)==0;
+}
+
+int Placement::cpu(int index) const{
+    return allowed[index%allowed.size()];
+}
+
+bool Placement::pin(int index,pthread_t thread) const{
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu(index),&mask);
+    return pthread_setaffinity_np(thread,sizeof(mask),&mask)==0;
+}
+
+bool Placement::localize(const string& stage,void* p,size_t bytes) const{
+    int n=node(stage);
+    if(n<0 || nodeCpus.size()<2 || !bytes)
+        return false;
+    long page=sysconf(_SC_PAGESIZE);
+    size_t start=(size_t)p & ~(size_t)(page-1);
+    size_t len=(size_t)p+bytes-start;
+    unsigned long nodemask[16];
+    memset(nodemask,0,sizeof(nodemask));
+    if(n>=(int)(sizeof(nodemask)*8))
+        return false;
+    nodemask[n/(8*sizeof(unsigned long))]|=1ul<<(n%(8*sizeof(unsigned long)));
+#ifdef SYS_mbind
+    return syscall(SYS_mbind,start,len,PLACEMENT_MPOL_BIND,nodemask,sizeof(nodemask)*8,PLACEMENT_MPOL_MF_MOVE)==0;
+#else
+    return false;
+#endif
+}
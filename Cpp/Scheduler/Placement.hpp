@@ -0,0 +1,60 @@
+#ifndef PLACEMENT_HPP
+#define PLACEMENT_HPP
+//Which CPUs each named stage of DTAM runs on.
+//
+// The topology (physical cores, their SMT siblings, NUMA nodes) is read from
+// sysfs and intersected with the process affinity mask, which is where a
+// container's cgroup cpuset shows up, so a stage never lands on a CPU the
+// process does not own. Cores and nodes in a config are numbered within
+// that allowed set, so the same file works inside and outside a container.
+//
+// Config file ($DTAM_PLACEMENT, or load()), one stage per line, # comments:
+//   track      thread 0     first hardware thread of allowed core 0
+//   cost       node 0       every allowed CPU of NUMA node 0
+//   optimizer  core 1-3     cores 1 to 3, all of their SMT threads
+//   gui        cpu 7        logical CPU 7, if allowed
+//   default    any          the whole allowed set
+// Stages: track, cost, optimizer (the TaskPool, where QD and A run; "qd"
+// and "a" are accepted too), gui, and default for anything unlisted.
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include <stddef.h>
+
+class Placement{
+public:
+    Placement();//reads the topology, default placement
+
+    static Placement& global();//also loads $DTAM_PLACEMENT if set
+
+    bool load(const std::string& file);//false if unreadable or malformed, earlier lines still apply
+    bool set(const std::string& stage,const std::string& spec);//one config line's worth
+
+    const std::vector<int>& cpus(const std::string& stage) const;
+    int node(const std::string& stage) const;//NUMA node if the stage is within one, else -1
+    bool apply(const std::string& stage,pthread_t thread=pthread_self()) const;
+    int cpu(int index) const;//index-th allowed CPU, wrapping, for the old numeric affinities
+    bool pin(int index,pthread_t thread=pthread_self()) const;//to cpu(index) alone, false if refused
+
+    //Moves [p,p+bytes) to the stage's node, for stages holding big buffers
+    // (the cost volume). Pages not yet touched are placed there on first touch.
+    bool localize(const std::string& stage,void* p,size_t bytes) const;
+
+    int cores() const{
+        return coreCpus.size();
+    }
+
+private:
+    std::vector<int> allowed;               //CPUs the process may use
+    std::vector<std::vector<int> > coreCpus;//allowed CPUs of each physical core, SMT siblings together
+    std::map<int,std::vector<int> > nodeCpus;//allowed CPUs of each NUMA node
+    std::map<int,int> cpuNode;
+    std::map<std::string,std::vector<int> > stages;
+
+    void readTopology();
+    void defaults();
+    static std::string canonical(const std::string& stage);
+};
+
+#endif
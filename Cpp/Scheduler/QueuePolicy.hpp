@@ -0,0 +1,24 @@
+#ifndef QUEUE_POLICY_HPP
+#define QUEUE_POLICY_HPP
+//What a bounded frame queue does when a push finds it full.
+// For a live camera a stale pose is worse than a skipped frame, so the
+// tracking queues default to keeping only the newest frames.
+#include <stddef.h>
+
+enum OverflowPolicy{
+    OVERFLOW_BLOCK,       //producer waits for room (lossless, latency grows)
+    OVERFLOW_DROP_NEWEST, //the incoming element is discarded
+    OVERFLOW_DROP_OLDEST, //the oldest queued element is evicted to make room, a few tries then the incoming one is discarded
+    OVERFLOW_KEEP_LATEST=OVERFLOW_DROP_OLDEST//with keep=N, queue holds at most the newest N
+};
+
+//Snapshot of a queue's occupancy, counters are since construction
+struct QueueStats{
+    size_t size;    //elements queued now
+    size_t limit;   //size at which the overflow policy kicks in, 0 means unbounded
+    size_t peak;    //high water mark of size
+    size_t pushed;  //elements accepted
+    size_t dropped; //elements discarded by the overflow policy, either end
+};
+
+#endif
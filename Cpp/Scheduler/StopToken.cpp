@@ -0,0 +1,27 @@
+#include "StopToken.hpp"
+
+void StopToken::requestStop(){
+    ScopeLock s(mutex);
+    if(stopped.exchange(1,std::memory_order_seq_cst))
+        return;
+    //set before waking, a waiter rechecks it after announcing itself
+    for(size_t i=0;i<wakers.size();i++)
+        wakers[i].second();
+}
+
+int StopToken::attach(const Waker& w){
+    ScopeLock s(mutex);
+    int id=nextId++;
+    wakers.push_back(std::make_pair(id,w));
+    return id;
+}
+
+void StopToken::detach(int id){
+    ScopeLock s(mutex);
+    for(size_t i=0;i<wakers.size();i++){
+        if(wakers[i].first==id){
+            wakers.erase(wakers.begin()+i);
+            return;
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef STOP_TOKEN_HPP
+#define STOP_TOKEN_HPP
+//Cooperative cancellation for the stage threads.
+//
+// A blocking primitive (the queues, stacks, TaskPool::wait) is tied to a
+// token with cancelOn(&token). requestStop() then wakes everything blocked
+// in it, and from there on it stops and drains:
+//   pop/peek  still hand out what is readable, and only once that is gone
+//             return false (or T()) instead of sleeping
+//   push      never blocks for room any more, returns false instead
+// A read stalled queue stays stalled, its contents are left for the owner.
+// So a stage loop written as
+//   while(q.pop(item)) work(item);
+// finishes what it was given and returns.
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <functional>
+#include "ImplMutex.hpp"
+
+class StopToken{
+public:
+    typedef std::function<void()> Waker;
+
+    StopToken():stopped(0),nextId(1){}
+
+    void requestStop();//idempotent, runs the wakers once
+    bool stopRequested() const{
+        return stopped.load(std::memory_order_seq_cst)!=0;//pairs with a waiter's prepareWait
+    }
+
+    //w must wake the blocked threads of one primitive. It is called with the
+    // token's lock held, so it must not attach or detach itself.
+    int attach(const Waker& w);
+    void detach(int id);
+
+private:
+    std::atomic<int> stopped;
+    ImplMutex mutex;
+    std::vector<std::pair<int,Waker> > wakers;
+    int nextId;
+
+    StopToken(const StopToken&);
+    StopToken& operator = (const StopToken&);
+};
+
+//A primitive's link to its token. Declare it after the cond vars or
+// EventCounts its waker touches, so it detaches before they are destroyed.
+class StopLink{
+public:
+    StopLink():token(NULL),id(0){}
+    ~StopLink(){
+        set(NULL,StopToken::Waker());
+    }
+    void set(StopToken* t,const StopToken::Waker& w){
+        if(token)
+            token->detach(id);
+        token=t;
+        id=t ? t->attach(w) : 0;
+    }
+    bool stopped() const{
+        return token && token->stopRequested();
+    }
+
+private:
+    StopToken* token;
+    int id;
+
+    StopLink(const StopLink&);
+    StopLink& operator = (const StopLink&);
+};
+
+#endif
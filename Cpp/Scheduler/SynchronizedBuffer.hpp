@@ -1,78 +1,93 @@
+#ifndef SYNCHRONIZED_BUFFER_HPP
+#define SYNCHRONIZED_BUFFER_HPP
+#include <deque>
+#include <vector>
 #include "ImplMutex.hpp"
+#include "QueuePolicy.hpp"
+#include "StopToken.hpp"
 
 template <class T>
-class StallableSynchronizedQueue{
+class StallableSynchronizedStack{
 public:
-    //void push(T &in);
+    //void push(T& in);
     //T pop();
+    //std::vector<T> peekn(int i=1);
+    //std::vector<T> newest(size_t n);
     //void readStall();
     //void readUnstall();
-    ImplMutex mutex;
     
 private:
-    int _readStall;
+    ImplMutex mutex;
+    std::deque<T > q;
+    int _readStall;//only touched under mutex
     ImplCondVar cond;
-    std::deque<T> q;
+    ImplCondVar notFull;
+    OverflowPolicy policy;
+    size_t limit;
+    size_t peak,pushed,dropped;
+    StopLink stop;
+    
 public:
-    void push(T& in){
-        mutex.lock();
-        q.push_back(in);
-        cond.signal();
-        mutex.unlock();
-    }
+    StallableSynchronizedStack():_readStall(0),policy(OVERFLOW_BLOCK),limit(0),peak(0),pushed(0),dropped(0){}
     
-    T pop(){// a real pop that takes the element off the end
-        T out;
-        mutex.lock();
-        while(q.size()==0||_readStall){
-            cond.wait(mutex);
-        }
-        out=q.front();
-        q.pop_front();
-        if (q.size()>0){
-            cond.signal();
-        }
-        mutex.unlock();
-        return out;
-    }
-    void readStall(){
-        _readStall=1;
+    //pops, peeks and blocked pushes give up once token is stopped
+    void cancelOn(StopToken* token){
+        stop.set(token,[this](){
+            mutex.lock();
+            cond.broadcast();
+            notFull.broadcast();
+            mutex.unlock();
+        });
     }
-    void readUnstall(){
-        _readStall=0;
+    
+    //keep=0 leaves the stack unbounded (the default)
+    void setOverflow(OverflowPolicy p,size_t keep=0){
         mutex.lock();
-        cond.broadcast();//will this really work?
+        policy=p;
+        limit=keep;
         mutex.unlock();
     }
-};
-
-template <class T>
-class StallableSynchronizedStack{
-public:
-    //void push(T& in);
-    //T pop();
-    //std::vector<T> peekn(int i=1);
-    //void readStall();
-    //void readUnstall();
-    ImplMutex mutex;
-    std::deque<T > q;
-    
-private:
-    int _readStall;
-    ImplCondVar cond;
     
-public:
-    void push(T& in){
+    bool push(T& in){//false if in was dropped
         mutex.lock();
+        if(limit){
+            if(policy==OVERFLOW_BLOCK){
+                while(q.size()>=limit){
+                    if(stop.stopped()){
+                        mutex.unlock();
+                        return false;
+                    }
+                    notFull.wait(mutex);
+                }
+            }else if(policy==OVERFLOW_DROP_NEWEST){
+                if(q.size()>=limit){
+                    dropped++;
+                    mutex.unlock();
+                    return false;
+                }
+            }else{
+                while(q.size()>=limit){
+                    q.pop_front();
+                    dropped++;
+                }
+            }
+        }
         q.push_back(in);
+        pushed++;
+        if(q.size()>peak)
+            peak=q.size();
         cond.signal();
         mutex.unlock();
+        return true;
     }
     
-    T pop(){// a real pop that takes the element off the end
-        T out;
+    bool pop(T& out){//false once stopped and drained
         mutex.lock();
         while(q.size()==0||_readStall){
+            if(stop.stopped()){
+                mutex.unlock();
+                return false;
+            }
             cond.wait(mutex);
         }
         out=q.back();
@@ -80,23 +95,37 @@ public:
         if (q.size()>0){
             cond.signal();
         }
+        notFull.signal();
         mutex.unlock();
+        return true;
+    }
+    T pop(){// a real pop that takes the element off the end
+        T out;
+        pop(out);
         return out;
     }
-    T peek(){
+    T peek(){//T() once stopped and empty
         mutex.lock();
         while(q.size()<1||_readStall){
+            if(stop.stopped()){
+                mutex.unlock();
+                return T();
+            }
             cond.wait(mutex);
         }
         T out = q.back();
         mutex.unlock();
         return out;
     }
-    std::vector<T> peekn(int n=1){
+    std::vector<T> peekn(int n=1){//empty once stopped with fewer than n
         std::vector<T> out;
         mutex.lock();
         
         while(q.size()<n||_readStall){
+            if(stop.stopped()){
+                mutex.unlock();
+                return out;
+            }
             cond.wait(mutex);
         }
         std::reverse_iterator<typename std::deque<T>::iterator> it=q.rbegin();
@@ -107,13 +136,36 @@ public:
         mutex.unlock();
         return out;
     }
+    std::vector<T> newest(size_t n){//up to n elements, newest first, never waits
+        std::vector<T> out;
+        mutex.lock();
+        for(size_t i=0;i<n && i<q.size();i++)
+            out.push_back(q[q.size()-1-i]);
+        mutex.unlock();
+        return out;
+    }
+    QueueStats stats(){
+        QueueStats s;
+        mutex.lock();
+        s.size=q.size();
+        s.limit=limit;
+        s.peak=peak;
+        s.pushed=pushed;
+        s.dropped=dropped;
+        mutex.unlock();
+        return s;
+    }
     void readStall(){
+        mutex.lock();
         _readStall=1;
+        mutex.unlock();
     }
     void readUnstall(){
-        _readStall=0;
         mutex.lock();
-        cond.broadcast();//will this really work?
+        _readStall=0;
+        cond.broadcast();//set and broadcast under the lock, a waiter can't miss it
         mutex.unlock();
     }
 };
+
+#endif
@@ -0,0 +1,198 @@
+#include "TaskPool.hpp"
+#include "Placement.hpp"
+#include <sched.h>
+#include <stdio.h>
+#include <algorithm>
+
+//index of the pool worker running on this thread, -1 elsewhere
+static __thread int taskWorker=-1;
+static __thread TaskPool* taskWorkerPool=NULL;
+
+TaskPool::TaskPool(int threads){
+    if(threads<=0)//one per CPU the optimizer stage may use
+        threads=Placement::global().cpus("optimizer").size();
+    if(threads<=0)
+        threads=1;
+    for(int p=0;p<TASK_PRIORITIES;p++)
+        queued[p]=0;
+    next=0;
+    stop=0;
+    workers.resize(threads);
+    for(int i=0;i<threads;i++){
+        workers[i]=new Worker;
+        workers[i]->pool=this;
+        workers[i]->index=i;
+    }
+    for(int i=0;i<threads;i++){
+        pthread_create(&workers[i]->thread,NULL,launch,(void*)workers[i]);
+        char name[16];
+        snprintf(name,sizeof(name),"ODMPool%d",i);
+        pthread_setname_np(workers[i]->thread,name);
+    }
+}
+
+TaskPool::~TaskPool(){
+    stop=1;
+    work.notifyAll();
+    for(size_t i=0;i<workers.size();i++){
+        pthread_join(workers[i]->thread,NULL);
+        delete workers[i];
+    }
+}
+
+TaskPool& TaskPool::global(){
+    static TaskPool pool;
+    return pool;
+}
+
+void TaskPool::submit(const Task& task,TaskPriority priority,TaskGroup* group){
+    if(group)
+        group->pending.fetch_add(1,std::memory_order_relaxed);
+    int w=(taskWorkerPool==this) ? taskWorker : next.fetch_add(1,std::memory_order_relaxed)%workers.size();
+    Entry e;
+    e.task=task;
+    e.group=group;
+    {
+        ScopeLock s(workers[w]->mutex);
+        workers[w]->q[priority].push_back(e);
+    }
+    queued[priority].fetch_add(1,std::memory_order_release);
+    work.notifyOne();
+}
+
+//Most urgent first, down to maxPriority. At each level: own newest, then
+// steal the oldest of the others.
+bool TaskPool::take(int self,Entry& out,int maxPriority){
+    int n=workers.size();
+    int start=self>=0 ? self : 0;
+    for(int p=0;p<=maxPriority;p++){
+        if(!queued[p].load(std::memory_order_acquire))
+            continue;
+        if(self>=0){
+            Worker& w=*workers[self];
+            ScopeLock s(w.mutex);
+            if(!w.q[p].empty()){
+                out=w.q[p].back();
+                w.q[p].pop_back();
+                queued[p].fetch_sub(1,std::memory_order_relaxed);
+                return true;
+            }
+        }
+        for(int i=1;i<=n;i++){
+            Worker& v=*workers[(start+i)%n];
+            if(&v==workers[start] && self>=0)
+                continue;
+            if(!v.mutex.trylock())
+                continue;//busy, someone else is in there, try the next victim
+            bool got=!v.q[p].empty();
+            if(got){
+                out=v.q[p].front();
+                v.q[p].pop_front();
+                queued[p].fetch_sub(1,std::memory_order_relaxed);
+            }
+            v.mutex.unlock();
+            if(got)
+                return true;
+        }
+    }
+    return false;
+}
+
+bool TaskPool::anyQueued() const{
+    for(int p=0;p<TASK_PRIORITIES;p++){
+        if(queued[p].load(std::memory_order_acquire))
+            return true;
+    }
+    return false;
+}
+
+void TaskGroup::finish(){
+    finishing.fetch_add(1,std::memory_order_relaxed);//seen by whoever sees pending reach 0
+    if(pending.fetch_sub(1,std::memory_order_acq_rel)==1)
+        finished.notifyAll();
+    finishing.fetch_sub(1,std::memory_order_release);
+}
+
+void TaskGroup::settle(){
+    while(finishing.load(std::memory_order_acquire))
+        sched_yield();//only ever the few instructions after the last decrement
+}
+
+bool TaskPool::runOne(int self,int maxPriority){
+    Entry e;
+    if(!take(self,e,maxPriority))
+        return false;
+    e.task();
+    if(e.group)
+        e.group->finish();
+    return true;
+}
+
+void* TaskPool::launch(void* data){
+    Worker* w=(Worker*)data;
+    taskWorker=w->index;
+    taskWorkerPool=w->pool;
+    Placement::global().apply("optimizer");
+    w->pool->run(*w);
+    return NULL;
+}
+
+void TaskPool::run(Worker& self){
+    while(!stop.load(std::memory_order_acquire)){
+        if(runOne(self.index))
+            continue;
+        unsigned key=work.prepareWait();
+        if(stop.load(std::memory_order_acquire) || runOne(self.index)){
+            work.cancelWait();
+            continue;
+        }
+        if(anyQueued()){//lost a trylock race, the task is still out there
+            work.cancelWait();
+            sched_yield();
+            continue;
+        }
+        work.wait(key);
+    }
+}
+
+bool TaskPool::wait(TaskGroup& group,StopToken* stop){
+    return waitFor(group,TASK_PRIORITIES-1,stop);
+}
+
+//Helps with tasks up to maxPriority, sleeps on the group when there are none
+bool TaskPool::waitFor(TaskGroup& group,int maxPriority,StopToken* stop){
+    int self=(taskWorkerPool==this) ? taskWorker : -1;
+    StopLink link;
+    if(stop)
+        link.set(stop,[&group](){group.finished.notifyAll();});
+    while(!group.done()){
+        if(link.stopped())
+            return false;
+        if(runOne(self,maxPriority))
+            continue;
+        unsigned key=group.finished.prepareWait();
+        if(group.done() || link.stopped()){
+            group.finished.cancelWait();
+            continue;
+        }
+        group.finished.wait(key);
+    }
+    group.settle();
+    return true;
+}
+
+void TaskPool::parallelFor(int begin,int end,const std::function<void(int,int)>& body,TaskPriority priority){
+    int n=end-begin;
+    if(n<=0)
+        return;
+    int chunks=std::min(n,2*(threads()+1));
+    TaskGroup group;
+    const std::function<void(int,int)>* f=&body;
+    for(int c=1;c<chunks;c++){//chunk 0 is the caller's
+        int b=begin+(int)((long)n*c/chunks);
+        int e=begin+(int)((long)n*(c+1)/chunks);
+        submit(Task([f,b,e](){(*f)(b,e);}),priority,&group);
+    }
+    body(begin,begin+n/chunks);
+    waitFor(group,priority,NULL);
+}
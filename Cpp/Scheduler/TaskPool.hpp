@@ -0,0 +1,115 @@
+#ifndef TASK_POOL_HPP
+#define TASK_POOL_HPP
+//Work-stealing pool shared by the tracking, cost volume, optimizer and
+// reprojection stages, instead of one pinned pthread per loop.
+//
+// Priorities follow Planning.txt:
+//   Level 1.1  TASK_TRACK  keep the ESM chain aligned (the alignment level kernels)
+//   Level 1.2  TASK_MAP    make sure there is a valid depth map to align against
+//                          (cost volume layers, image decode and conversion)
+//   Level 2.1  TASK_REFINE improve the current depth map (optimizer iterations)
+// A worker always takes the most urgent task it can find, its own first
+// (newest first, as Planning.txt asks for frames and maps), then stolen
+// from the oldest end of another worker. Tasks are not interrupted; long
+// background work runs as short tasks that resubmit themselves, so
+// tracking gets a core within one slice.
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <pthread.h>
+#include "ImplMutex.hpp"
+#include "EventCount.hpp"
+#include "StopToken.hpp"
+
+enum TaskPriority{
+    TASK_TRACK=0,
+    TASK_MAP=1,
+    TASK_REFINE=2,
+    TASK_PRIORITIES=3
+};
+
+//Counts outstanding tasks so a caller can wait for a batch. The task that
+// finishes it wakes the waiters, so a waiter with nothing left to help
+// with sleeps instead of spinning.
+class TaskGroup{
+public:
+    TaskGroup():pending(0),finishing(0){}
+    bool done() const{
+        return pending.load(std::memory_order_acquire)==0;
+    }
+private:
+    friend class TaskPool;
+    void finish();//one task done
+    void settle();//once done, waits out finish() calls still touching the group
+    std::atomic<int> pending;
+    std::atomic<int> finishing;//tasks inside finish(), the group must outlive them
+    EventCount finished;
+};
+
+class TaskPool{
+public:
+    typedef std::function<void()> Task;
+
+    //threads=0 uses one per CPU of the "optimizer" Placement stage
+    explicit TaskPool(int threads=0);
+    ~TaskPool();
+
+    void submit(const Task& task,TaskPriority priority=TASK_MAP,TaskGroup* group=NULL);
+    template <typename Object>
+    void submit(Object& object,void (Object::*func)(),TaskPriority priority=TASK_MAP,TaskGroup* group=NULL){
+        Object* o=&object;
+        submit(Task([o,func](){(o->*func)();}),priority,group);
+    }
+
+    //Runs tasks on the calling thread until group is done, and sleeps once
+    // there is nothing to take. False if stop was requested first, the
+    // group's tasks then finish on their own.
+    bool wait(TaskGroup& group,StopToken* stop=NULL);
+
+    //Calls body(begin,end) on chunks of [begin,end) as tasks at priority and
+    // returns when all are done. The caller works through them too, but
+    // never picks up anything less urgent while it waits.
+    void parallelFor(int begin,int end,const std::function<void(int,int)>& body,TaskPriority priority);
+
+    int threads() const{
+        return workers.size();
+    }
+    int pending(TaskPriority priority) const{
+        return queued[priority].load(std::memory_order_relaxed);
+    }
+
+    //The process wide pool the OpenDTAM stages share
+    static TaskPool& global();
+
+private:
+    struct Entry{
+        Task task;
+        TaskGroup* group;
+    };
+    struct Worker{
+        ImplMutex mutex;
+        std::deque<Entry> q[TASK_PRIORITIES];
+        pthread_t thread;
+        TaskPool* pool;
+        int index;
+    };
+
+    static void* launch(void* data);
+    void run(Worker& self);
+    bool take(int self,Entry& out,int maxPriority);
+    bool runOne(int self,int maxPriority=TASK_PRIORITIES-1);
+    bool waitFor(TaskGroup& group,int maxPriority,StopToken* stop);
+    bool anyQueued() const;
+
+    std::vector<Worker*> workers;
+    std::atomic<int> queued[TASK_PRIORITIES];
+    std::atomic<unsigned> next;
+    std::atomic<int> stop;
+    EventCount work;
+
+    TaskPool(const TaskPool&);
+    TaskPool& operator = (const TaskPool&);
+};
+
+#endif
@@ -10,7 +10,9 @@ using namespace std;
 #include "utils/utils.hpp"
 #include "graphics.hpp"
 #include "Track.hpp"
+#include "Scheduler/TaskPool.hpp"
 #include "stdio.h"
+#include <string.h>
 
 
 //debug
@@ -20,7 +22,6 @@ using namespace std;
 
 const static float FAIL_FRACTION=0.30;
 
-enum alignment_modes{CV_DTAM_REV,CV_DTAM_FWD,CV_DTAM_ESM};
 const double small0=.1;//~6deg, not trivial, but hopefully enough to make the translation matter
 
 static void getGradient(const Mat& image,Mat & grad);
@@ -37,26 +38,23 @@ static void getGradient(const Mat& image,Mat & grad);
 //
 //}
 
-static Mat paramsToProjection(const Mat & p,const Mat& _cameraMatrix){
+//Closed form inverse of the padded camera matrix [K 0;0 1], K upper triangular
+static Matx44d cameraInverse(const Matx44d& K){
+    double fx=K(0,0),s=K(0,1),cx=K(0,2),fy=K(1,1),cy=K(1,2);
+    assert(K(1,0)==0 && K(2,0)==0 && K(2,1)==0 && K(2,2)==1);
+    return Matx44d(1/fx,-s/(fx*fy),(s*cy-cx*fy)/(fx*fy),0.0,
+                   0.0, 1/fy,      -cy/fy,              0.0,
+                   0.0, 0.0,       1.0,                 0.0,
+                   0.0, 0.0,       0.0,                 1.0);
+}
+
+static Matx34d paramsToProjection(const Vec6d& p,const Matx44d& cameraMatrix,const Matx44d& cameraInv){
     //Build the base transform
-    assert(p.type()==CV_64FC1);
-    Mat dR=rodrigues(p.colRange(Range(0,3)));
-    Mat dT=p.colRange(Range(3,6)).t();
-    Mat dA;
-    hconcat(dR,dT,dA);
-    dA=make4x4(dA);
-    Mat cameraMatrix=make4x4(_cameraMatrix);
-    assert(cameraMatrix.type()==CV_64FC1);
-    Mat proj=cameraMatrix*dA*cameraMatrix.inv();
-//     cout<<"p: "<<"\n"<< p<< endl;
-//     cout<<"Proj: "<<"\n"<< proj<< endl;
-    //The column swap
-    Mat tmp=proj.colRange(2,4).clone();
-    tmp.col(1).copyTo(proj.col(2));
-    tmp.col(0).copyTo(proj.col(3));
-    //The row drop
-    proj=proj.rowRange(0,3);
-    return proj;
+    Matx44d proj=cameraMatrix*SE3::fromLie(p).matrix()*cameraInv;
+    //The column swap and the row drop
+    return Matx34d(proj(0,0),proj(0,1),proj(0,3),proj(0,2),
+                   proj(1,0),proj(1,1),proj(1,3),proj(1,2),
+                   proj(2,0),proj(2,1),proj(2,3),proj(2,2));
 }
 
 static Mat&  makeGray(Mat& image){
@@ -86,26 +84,6 @@ static void getGradient(const Mat& image,Mat & grad){
     Scharr( gray, grad_y, CV_32FC1, 0, 1, 1.0/26.0, 0, BORDER_REPLICATE);
 }
 
-static void getGradient_8(const Mat& image,Mat & grad){
-    //Image gradients for alignment
-    //Note that these gradients have theoretical problems under the sudden 
-    // changes model of images. It might be wise to blur the images before 
-    // alignment, to avoid sudden changes, but that makes occlusion more 
-    // problematic.
-    grad.create(2,image.rows*image.cols,CV_32FC1);
-    Mat gray;
-    if (image.type()==CV_32FC1) {
-        gray=image;
-    }else {
-        cvtColor(image, gray, cv::COLOR_BGR2GRAY);
-        gray.convertTo(gray,CV_32FC1);
-    }
-    Mat grad_x(image.rows,image.cols,CV_32FC1,grad.row(0).data);
-    Scharr( gray, grad_x, CV_32FC1, 1, 0, 1.0/26.0, 0, BORDER_REPLICATE );
-    Mat grad_y(image.rows,image.cols,CV_32FC1,grad.row(1).data);
-    Scharr( gray, grad_y, CV_32FC1, 0, 1, 1.0/26.0, 0, BORDER_REPLICATE);
-}
-
 static void getGradientInterleave(const Mat& image,Mat & grad){
     //Image gradients for alignment
     //Note that these gradients have theoretical problems under the sudden 
@@ -135,204 +113,525 @@ static void Mask(const Mat& in,const Mat& m,Mat& out){
     out=out.mul(tmp/255);
 }
 
-bool Track::align_level_largedef_gray_forward(const Mat& T,//Total Mem cost ~185 load/stores of image
-                          const Mat& d,
-                          const Mat& _I,
-                          const Mat& cameraMatrix,//Mat_<double>
-                          const Mat& _p,                //Mat_<double>
-                          int mode,
-                          float threshold,
-                          int numParams
-                                      )
-{
+// Integer images (8 or 16 bit gray) are tracked without converting to float.
+// Gradients are the same Scharr kernel as getGradient, kept in fixed point
+// (26x getGradient's scale, short for 8 bit, int for 16 bit), sampling is
+// bilinear with 8 fractional bits. Only the Jacobian and the normal
+// equations are float.
+static double intensityRange(int depth){
+    return depth==CV_8U ? 255.0 : (depth==CV_16U ? 65535.0 : 1.0);
+}
 
-    int r=_I.rows;
-    int rows=r;
-    int c=_I.cols;
-    int cols=c;
-    const float small=small0;
-    //Build the in map (Mem cost 3 layer store:3)
-    Mat_<Vec3f> idMap3;
-    {
-        idMap3.create(r,c);//[rows][cols][3]
-        float* id3=(float*) (idMap3.data);
-        float* dp=(float*) (d.data);
-        int offset=0;
-        for(int i=0;i<r;i++){
-            for(int j=0;j<c;j++,offset++){
-                id3[offset*3+0]=j;
-                id3[offset*3+1]=i;
-                id3[offset*3+2]=dp[offset];
-            }
+//planar 2xN like getGradient, border replicated
+template<typename Tp,typename Gp>
+static void getGradientFixed(const Mat& image,Mat & grad){
+    int r=image.rows;
+    int c=image.cols;
+    grad.create(2,r*c,DataType<Gp>::depth);
+    for(int i=0;i<r;i++){
+        const Tp* u=image.ptr<Tp>(i>0?i-1:0);
+        const Tp* m=image.ptr<Tp>(i);
+        const Tp* d=image.ptr<Tp>(i<r-1?i+1:r-1);
+        Gp* gx=grad.ptr<Gp>(0)+i*c;
+        Gp* gy=grad.ptr<Gp>(1)+i*c;
+        for(int j=0;j<c;j++){
+            int l=j>0?j-1:0;
+            int rt=j<c-1?j+1:c-1;
+            gx[j]=(Gp)(3*((int)u[rt]-u[l])+10*((int)m[rt]-m[l])+3*((int)d[rt]-d[l]));
+            gy[j]=(Gp)(3*((int)d[l]-u[l])+10*((int)d[j]-u[j])+3*((int)d[rt]-u[rt]));
         }
     }
-    
-    //Build the unincremented transform: (Mem cost 2 layer store,3 load :5)
-    Mat baseMap(rows,cols,CV_32FC2);
-    {
-        Mat tmp=_p.clone();
-        Mat baseProj=paramsToProjection(_p,cameraMatrix);
-        perspectiveTransform(idMap3,baseMap,baseProj);
-        assert(baseMap.type()==CV_32FC2);
+}
+
+//The gradient the kernels sample for an image of this depth
+static int gradientDepth(int depth){
+    return depth==CV_8U ? CV_16S : (depth==CV_16U ? CV_32S : CV_32F);
+}
+static void imageGradient(const Mat& image,Mat& grad){
+    switch(image.depth()){
+        case CV_8U:
+            getGradientFixed<uchar,short>(image,grad);
+            break;
+        case CV_16U:
+            getGradientFixed<ushort,int>(image,grad);
+            break;
+        default:
+            getGradient(image,grad);
     }
-    
-    
-    // reproject the gradient and image at the same time (Mem cost >= 24)
-    Mat gradI;
-    Mat I(r,c,CV_32FC1);
-    {
-        getGradient(_I,gradI); //(Mem cost: min 2 load, 2 store :4)
-        Mat toMerge[3]={_I,
-                        Mat(r,c,CV_32FC1,(float*)gradI.data),
-                        Mat(r,c,CV_32FC1,((float*)gradI.data)+r*c)};
-        Mat packed;
-        merge(toMerge,3,packed); //(Mem cost: min 3 load, 3 store :6)
-        Mat pulledBack;
-        
-        remap( packed, pulledBack, baseMap,Mat(), cv::INTER_LINEAR, BORDER_CONSTANT,0.0 );//(Mem cost:?? 5load, 3 store:8)
-        gradI.create(r,c,CV_32FC2);
-
-        int from_to[] = { 0,0, 1,1, 2,2 };
-        Mat src[1]={pulledBack};
-        Mat dst[2]={I,gradI};
-        
-        mixChannels(src,1,dst,2,from_to,3);// extract the image and the resampled gradient //(Mem cost: min 3 load, 3 store :6)
-        
-        
-        if(cv::countNonZero(I)<rows*cols*FAIL_FRACTION){//tracking failed!
+}
+
+static inline int lerp8(int a,int b,int f){
+    return a+(((b-a)*f+128)>>8);
+}
+
+//A bilinear sample position, set() is false outside the image (or nan)
+struct Tap{
+    int o00,o01,o10,o11;//offsets of the 4 neighbours
+    float fx,fy;        //fractions for float images
+    int ix,iy;          //and in 1/256ths for integer ones
+    inline bool set(float x,float y,int rows,int cols){
+        if(!(x>=0 && y>=0 && x<=cols-1 && y<=rows-1))
             return false;
+        int x0=(int)x;
+        int y0=(int)y;
+        fx=x-x0;
+        fy=y-y0;
+        ix=(int)(fx*256+.5f);
+        iy=(int)(fy*256+.5f);
+        int x1=x0<cols-1?x0+1:x0;
+        int y1=y0<rows-1?y0+1:y0;
+        o00=y0*cols+x0;
+        o01=y0*cols+x1;
+        o10=y1*cols+x0;
+        o11=y1*cols+x1;
+        return true;
+    }
+};
+
+static inline float tapValue(const float* p,const Tap& t){
+    float a=p[t.o00]+(p[t.o01]-p[t.o00])*t.fx;
+    float b=p[t.o10]+(p[t.o11]-p[t.o10])*t.fx;
+    return a+(b-a)*t.fy;
+}
+template<typename Vp>
+static inline int tapValue(const Vp* p,const Tap& t){
+    return lerp8(lerp8(p[t.o00],p[t.o01],t.ix),lerp8(p[t.o10],p[t.o11],t.ix),t.iy);
+}
+
+// One level of the alignment in a single pass: the base and incremented
+// warps are made from (x,y,invdepth) on the fly, the image and gradient
+// sampled, and each pixel's Jacobian row folded straight into the normal
+// equations, so no full image intermediates exist. Rows are split into
+// stripes with their own sums, added up in stripe order afterwards so the
+// result is the same however the stripes were scheduled.
+template<typename Tp,typename Gp>
+class LevelKernel : public ParallelLoopBody{
+public:
+    const Mat& T;
+    const Mat& d;
+    const Mat& I;
+    const Mat& gradI;
+    const Mat& gradT;//empty unless ESM
+    Matx34d base;
+    const Matx34d* proj;//numParams incremented projections
+    int numParams;
+    float threshold;
+    float gscale;//takes the gradients to getGradient's scale
+    int stripeRows;
+    LevelSums* sums;
+
+    LevelKernel(const Mat& _T,const Mat& _d,const Mat& _I,const Mat& _gradI,const Mat& _gradT)
+        :T(_T),d(_d),I(_I),gradI(_gradI),gradT(_gradT){}
+
+    void operator()(const Range& range) const{
+        int rows=I.rows;
+        int cols=I.cols;
+        const Tp* ip=I.ptr<Tp>(0);
+        const Gp* gix=numParams?gradI.ptr<Gp>(0):NULL;
+        const Gp* giy=numParams?gradI.ptr<Gp>(1):NULL;
+        bool esm=!gradT.empty();
+        for(int s=range.start;s<range.end;s++){
+            LevelSums& acc=sums[s];
+            acc.clear();
+            int iend=std::min(rows,(s+1)*stripeRows);
+            for(int i=s*stripeRows;i<iend;i++){
+                const Tp* tp=T.ptr<Tp>(i);
+                const float* dp=d.ptr<float>(i);
+                for(int j=0;j<cols;j++){
+                    Vec4d X(j,i,dp[j],1.0);
+                    Vec3d b=base*X;
+                    if(!(b[2]>0))//behind the camera
+                        continue;
+                    float x=b[0]/b[2];
+                    float y=b[1]/b[2];
+                    Tap t;
+                    if(!t.set(x,y,rows,cols))
+                        continue;
+                    float Iv=tapValue(ip,t);
+                    if(!(Iv>0))
+                        continue;
+                    acc.valid++;
+                    float e=(float)tp[j]-Iv;
+                    float ae=fabsf(e);
+                    acc.absErr+=ae;
+                    if(!(ae<threshold))
+                        continue;
+                    acc.inliers++;
+                    acc.sqErr+=e*e;
+                    if(!numParams)
+                        continue;
+                    
+                    float gx=tapValue(gix,t);
+                    float gy=tapValue(giy,t);
+                    if(esm){
+                        int o=i*cols+j;
+                        gx=.5f*(gx+gradT.ptr<Gp>(0)[o]);
+                        gy=.5f*(gy+gradT.ptr<Gp>(1)[o]);
+                    }
+                    gx*=gscale;
+                    gy*=gscale;
+                    //J*small=dI/dMap*dMap/dp*small
+                    float J[6];
+                    for(int k=0;k<numParams;k++){
+                        Vec3d q=proj[k]*X;
+                        J[k]=(float)((q[0]/q[2]-x)*gx+(q[1]/q[2]-y)*gy);
+                    }
+                    for(int a=0;a<numParams;a++){
+                        for(int c=0;c<=a;c++)
+                            acc.H[a][c]+=J[a]*J[c];
+                        acc.Je[a]+=J[a]*e;
+                    }
+                }
+            }
         }
-        
     }
+};
+
+template<typename Tp,typename Gp>
+static void runLevelKernel(const Mat& T,const Mat& d,const Mat& _I,const Mat& gradI,const Mat& gradT,
+                           const Matx34d& base,const Matx34d* proj,int numParams,float threshold,float gscale,
+                           vector<LevelSums>& sums,LevelSums& out){
+    const int stripeRows=8;
+    int stripes=(_I.rows+stripeRows-1)/stripeRows;
+    sums.resize(stripes);
+    LevelKernel<Tp,Gp> kernel(T,d,_I,gradI,gradT);
+    kernel.base=base;
+    kernel.proj=proj;
+    kernel.numParams=numParams;
+    kernel.threshold=threshold;
+    kernel.gscale=gscale;
+    kernel.stripeRows=stripeRows;
+    kernel.sums=&sums[0];
+    //on the shared pool at tracking priority, ahead of any map refinement
+    TaskPool::global().parallelFor(0,stripes,[&kernel](int b,int e){kernel(Range(b,e));},TASK_TRACK);
+    out.clear();
+    for(int s=0;s<stripes;s++)
+        out.add(sums[s]);
+}
+
+// Sets up and runs the kernel for the image type: float, or the 8/16 bit fixed point path.
+// threshold is in [0,1] intensity units for every type. The gradients and
+// stripe sums go to the level's scratch, except T's ESM gradient if a
+// cached one is given.
+static void levelSums(const Mat& T,
+                      const Mat& d,
+                      const Mat& _I,
+                      const Mat& cameraMatrix,
+                      const Vec6d& p0,
+                      int mode,
+                      float threshold,
+                      int numParams,
+                      bool compositional,
+                      const Mat& cachedGradT,
+                      LevelScratch& scratch,
+                      LevelSums& out)
+{
+    assert(T.type()==_I.type() && d.type()==CV_32FC1);
+    assert(T.isContinuous() && _I.isContinuous());
+    const float small=small0;
+    const Matx44d K=make4x4(cameraMatrix);
+    const Matx44d Kinv=cameraInverse(K);
     
-    // Calculate the differences and build mask for operations (Mem cost ~ 8)
-    Mat fit;
-    absdiff(T,I,fit);
-    Mat mask=(fit<threshold)&(I>0);
-    Mat err=T-I;
-    
-//     //debug
-//     {
-//         if (numParams==6){
-//         pfShow("Before iteration",_I);
-// //         if(I.rows==480){
-// //             Mask(I,fit<.05,I);
-// //             pfShow("Tracking Stabilized With Occlusion",I,0,Vec2d(0,1));
-// // //             gpause();
-// //         }
-// //         else{
-//             pfShow("After Iteration",I,0,Vec2d(0,1));
-//             pfShow("To match",T);
-// //         }
-//         }
-//     }
-    
-   
-    
-    
+    //the unincremented and incremented transforms
+    Matx34d base=paramsToProjection(p0,K,Kinv);
+    Matx34d proj[6];
+    for (int paramNum=0; paramNum<numParams; paramNum++) {
+        Vec6d p=p0;
+        if(compositional){
+            Vec6d e(0,0,0,0,0,0);
+            e[paramNum]=small;
+            p=LieAdd(e,p0);
+        }else{
+            p[paramNum]+=small;
+        }
+        proj[paramNum]=paramsToProjection(p,K,Kinv);
+    }
     
-    // Build Jacobians:
-    Mat Jsmall;
-    Jsmall.create(numParams,rows*cols,CV_32FC1);
-    int OM_OFFSET=0;//128;//offset helps keep cache from being clobbered by load/stores
-    Mat outContainer;
-    outContainer.create(numParams,rows*cols*2+OM_OFFSET,CV_32FC1);
+    Mat gradT;//left empty unless ESM
+    if(numParams){
+        imageGradient(_I,scratch.gradI);
+        if(mode==CV_DTAM_ESM){
+            if(cachedGradT.empty())
+                imageGradient(T,scratch.gradT);
+            gradT= cachedGradT.empty() ? scratch.gradT : cachedGradT;
+            assert(gradT.depth()==gradientDepth(T.depth()) && gradT.cols==T.rows*T.cols);
+        }
+    }
+    threshold*=intensityRange(_I.depth());
+    switch(_I.depth()){
+        case CV_8U:
+            runLevelKernel<uchar,short>(T,d,_I,scratch.gradI,gradT,base,proj,numParams,threshold,1.0f/26,scratch.stripes,out);
+            break;
+        case CV_16U:
+            runLevelKernel<ushort,int>(T,d,_I,scratch.gradI,gradT,base,proj,numParams,threshold,1.0f/26,scratch.stripes,out);
+            break;
+        default:
+            assert(_I.type()==CV_32FC1);
+            runLevelKernel<float,float>(T,d,_I,scratch.gradI,gradT,base,proj,numParams,threshold,1.0f,scratch.stripes,out);
+    }
+}
+
+// Rotation only pre-alignment. With the depth taken as infinite the warp
+// from T to I is the homography K*R*K^-1, so on the coarse levels it can
+// be solved directly: analytic Jacobian, ESM gradient, and the left
+// compositional update R=exp(w)*R. For a ray (a,b,1) rotated by w:
+//   da/dw=(-ab, 1+a^2, -b)   db/dw=(-(1+b^2), ab, a)
+// Returns the iterations used.
+template<typename Tp,typename Gp>
+static int alignRotationLevel(const Mat& T,const Mat& _I,const Matx33d& K,Matx33d& R,
+                              int maxIters,double stepTol,float gscale,LevelScratch& scratch){
+    assert(T.type()==_I.type() && T.isContinuous() && _I.isContinuous());
+    int rows=T.rows;
+    int cols=T.cols;
+    Mat& gradT=scratch.gradT;
+    Mat& gradI=scratch.gradI;
+    imageGradient(T,gradT);
+    imageGradient(_I,gradI);
+    const Tp* tp=T.ptr<Tp>(0);
+    const Tp* ip=_I.ptr<Tp>(0);
+    const Gp* gtx=gradT.ptr<Gp>(0);
+    const Gp* gty=gradT.ptr<Gp>(1);
+    const Gp* gix=gradI.ptr<Gp>(0);
+    const Gp* giy=gradI.ptr<Gp>(1);
+    const Matx33d Kinv=K.inv();
+    const double fx=K(0,0),s=K(0,1),cx=K(0,2),fy=K(1,1),cy=K(1,2);
     
-    //TODO: Whole loop cacheable except J multiplies if CV_DTAM_REV (Mem cost whole loop 17/itr: 102)
-    for (int paramNum=0; paramNum<numParams; paramNum++) {
-        
-        
-        
-        //Build the incremented transform
-        assert(_p.type()==CV_64FC1);
-        Mat_<double> p=_p.clone();
-        p(0,paramNum)+=small;
-        Mat proj=paramsToProjection(p,cameraMatrix);
-        
-        //get a row of dmap/dp
-        Mat outMap(rows,cols,CV_32FC2,((float*)outContainer.data)+rows*cols*2*paramNum+OM_OFFSET);
-        
-        perspectiveTransform(idMap3,outMap,proj);//outmap=baseMap+dMap/dp*small (Mem cost 5)
-        
-        
-        //subtract off the base to make a differential  (Mem cost 6)
-        //this cannot be done below in the J loop because it would need 5 pointers
-        // which is bad for cache (4-way set associative)
-//         Mat t1,t2;
-//         Mat tmp[2]={t1,t2};
-//         split(outMap,tmp);
-//         char s[500];
-//         sprintf(s,"diff0:%d",paramNum);
-//         pfShow(s,tmp[0]);
-//         pfShow("diff1",tmp[1]);
-        outMap-=baseMap;//outmap=dMap/dp*small
-//         split(outMap,tmp);
-//         pfShow("diff2",tmp[0]);
-//         pfShow("diff3",tmp[1]);
-        //multiply by appropriate gradient
-        
-        
-        //want:J*small=dI/dMap*dMap/dp*small
-        //do: Jsmall=sumChannels((outmap-idMap2).mul(merge(gradient[0],gradient[1])))
-        const float * om=(const float*) (outMap.data);
-        const float * bm=(const float*) (baseMap.data);
-        const float * gi=(const float*) (gradI.data);
-        const uchar * m = mask.data;
-        float* Jp=(float*) (Jsmall.row(paramNum).data);//the row of the jacobian we're computing
-        int offset = 0;
-        //TODO: this loop may work faster unrolled or hand sse/avx optimized (Mem cost 6)
-        //Warning this loop uses all 4 mappings in a 4 way cache!
-        //Unrolling to cache line size would allow a 5th pointer to be used.
-        for(float i=0;i<rows;i++){
-            for(float j=0;j<cols;j++,offset++){
-                float jx,jy;
-                jx = om[offset*2+0]*gi[offset*2+0];
-                jy = om[offset*2+1]*gi[offset*2+1];
-                Jp[offset]=m[offset]?jx+jy:0;
+    int it=0;
+    while(it<maxIters){
+        Matx33d M=R*Kinv;
+        Matx33d A=Matx33d::zeros();
+        Vec3d g(0,0,0);
+        int valid=0;
+        for(int i=0,o=0;i<rows;i++){
+            for(int j=0;j<cols;j++,o++){
+                Vec3d X=M*Vec3d(j,i,1.0);
+                if(!(X[2]>0))
+                    continue;
+                double a=X[0]/X[2];
+                double b=X[1]/X[2];
+                Tap t;
+                if(!t.set(fx*a+s*b+cx,fy*b+cy,rows,cols))
+                    continue;
+                float Iv=tapValue(ip,t);
+                if(!(Iv>0))
+                    continue;
+                valid++;
+                double e=(float)tp[j]-Iv;
+                double gx=.5f*gscale*(tapValue(gix,t)+gtx[o]);
+                double gy=.5f*gscale*(tapValue(giy,t)+gty[o]);
+                double da[3]={-a*b,1+a*a,-b};
+                double db[3]={-(1+b*b),a*b,a};
+                Vec3d J;
+                for(int k=0;k<3;k++)
+                    J[k]=gx*(fx*da[k]+s*db[k])+gy*fy*db[k];
+                A+=J*J.t();
+                g+=J*e;
             }
         }
-        //usleep(1000000);
+        if(valid<rows*cols*FAIL_FRACTION)//lost, leave R as it was
+            break;
+        Vec3d w=A.solve(g,DECOMP_SVD);
+        R=SO3::exp(w).R*R;
+        it++;
+        if(norm(w)<stepTol)
+            break;
+    }
+    return it;
+}
+
+int Track::align_rotation_level(const Mat& T,const Mat& _I,const Mat& cameraMatrix,Matx33d& R){
+    Matx33d K=Matx33d(Mat(cameraMatrix,Rect(0,0,3,3)));
+    LevelScratch& scratch=levelScratch(_I.size());
+    switch(_I.depth()){
+        case CV_8U:
+            return alignRotationLevel<uchar,short>(T,_I,K,R,maxIters,stepTol,1.0f/26,scratch);
+        case CV_16U:
+            return alignRotationLevel<ushort,int>(T,_I,K,R,maxIters,stepTol,1.0f/26,scratch);
+        default:
+            return alignRotationLevel<float,float>(T,_I,K,R,maxIters,stepTol,1.0f,scratch);
+    }
+}
+
+// Builds the small scaled normal equations of one level:
+//   Hss=Jsmall*Jsmall', Je=Jsmall*(T-I), dp=small*Hss^-1*Je
+// Parameters past numParams get an identity block, so their step is 0.
+// With compositional set the Jacobian is with respect to a left
+// perturbation, p'=LieAdd(dp,p), rather than p'=p+dp. That is the same
+// motion for every keyframe, so the equations of several can be summed.
+bool Track::normal_level_gray(const Mat& T,
+                          const Mat& d,
+                          const Mat& _I,
+                          const Mat& cameraMatrix,//Mat_<double>
+                          const Mat& _p,                //Mat_<double>
+                          int mode,
+                          float threshold,
+                          int numParams,
+                          bool compositional,
+                          Matx66d& Hss,
+                          Vec6d& Je,
+                          LevelStats* stats,
+                          const Mat& gradT
+                                      )
+{
+    assert(_p.type()==CV_64FC1);
+    LevelSums sums;
+    levelSums(T,d,_I,cameraMatrix,toLieVec(_p),mode,threshold,numParams,compositional,gradT,levelScratch(_I.size()),sums);
+    if(stats){
+        stats->pixels=_I.rows*_I.cols;
+        stats->valid=sums.valid;
+        stats->inliers=sums.inliers;
+        stats->rms=sums.inliers ? sqrt(sums.sqErr/sums.inliers)/intensityRange(_I.depth()) : 0;
+        stats->err=sums.valid ? sums.absErr/sums.valid/intensityRange(_I.depth()) : HUGE_VAL;
+        stats->condition=HUGE_VAL;
+    }
+    if(sums.valid<_I.rows*_I.cols*FAIL_FRACTION){//tracking failed!
+        return false;
     }
+    Hss=Matx66d::eye();
+    Je=Vec6d::all(0);
+    for(int a=0;a<numParams;a++){
+        for(int b=0;b<=a;b++)
+            Hss(a,b)=Hss(b,a)=sums.H[a][b];
+        Je[a]=sums.Je[a];
+    }
+    if(stats && numParams){
+        double ev[6];
+        Mat eig(numParams,1,CV_64FC1,ev);
+        eigen(Mat(6,6,CV_64FC1,Hss.val)(Rect(0,0,numParams,numParams)),eig);//descending
+        double lo=ev[numParams-1];
+        stats->condition= lo>0 ? ev[0]/lo : HUGE_VAL;
+    }
+    return true;
+}
+
+//dp=small*Hss^-1*Je, added to the first numParams of _p, or composed on
+// the left of all six with compositional set
+static void applyStep(const Matx66d& Hss,const Vec6d& Je,int numParams,bool compositional,const Mat& _p){
     //now want: dp=(J'J)^-1*J'*(T-I)
     //          dp=small*(Jsmall*Jsmall')^-1*Jsmall*(T-I) since Jsmall is already transposed
     //          dp=small*Hsmallsmall^-1*Jsmall*(T-I)
-    Mat Hss=Jsmall*Jsmall.t(); //Hessian (numParams^2) (Mem cost 6-36 depending on cache)
-    Hss.convertTo(Hss,CV_64FC1);
-    Mat Hinv=small*Hss.inv(DECOMP_SVD);  //TODO:cacheable for CV_DTAM_REV 
-    Hinv.convertTo(Hinv,CV_32FC1);
-    err=err.reshape(0,r*c);
-
-    Mat dp=(Hinv*(Jsmall*err)).t();//transpose because we decided that p is row vector (Mem cost 7)
-    dp.convertTo(dp,CV_64FC1);
-//     cout<<"Je: \n"<<Jsmall*err<<endl;
-//     cout<<"H: "<<"\n"<< Hss<< endl;
-//     cout<<"Hinv: "<<"\n"<< Hinv<< endl;
-//     cout<<"dp: "<<"\n"<< dp<< endl;
-    
-    
-    //Check amount of motion
-    {
-        
+    Vec6d dp;
+    if(!solve(Hss,Je,dp,DECOMP_CHOLESKY))//Hss is J*J', only singular if a direction is unconstrained
+        solve(Hss,Je,dp,DECOMP_SVD);
+    dp*=small0;
+    if(compositional){
+        Vec6d np=LieAdd(dp,toLieVec(_p));
+        Mat(1,6,CV_64FC1,np.val).copyTo(_p);
+    }else{
+        double* pp=_p.ptr<double>(0);//p is a row vector
+        for(int a=0;a<numParams;a++)
+            pp[a]+=dp[a];
     }
-    
-    //Check error
-    //For the pixels that are within threshold, the average error should go down (Expensive!)
-//     {
-//         Mat tmp=_p.clone();
-//         tmp.colRange(0,numParams)+=dp;
-//         Mat newMap,newBack;
-//         Mat newProj=paramsToProjection(tmp,cameraMatrix);
-//         perspectiveTransform(idMap3,newMap,newProj);
-//         remap( _I, newBack, newMap, Mat(), CV_INTER_LINEAR, BORDER_CONSTANT,-1.0/0.0 );
-//         Mat newFit;
-//         absdiff(T,newBack,newFit);
-//         Mat fitDiff;
-//         subtract(fit,newFit,fitDiff,mask & (newBack>0));
-//         double deltaErr=sum(fitDiff)[0];
-//         cout<<"Delta Err: "<< deltaErr<<endl;
-//         if (deltaErr<0)
-//             return false;
-//     }
-    _p.colRange(0,numParams)+=dp;
+}
+
+bool Track::align_level_largedef_gray_forward(const Mat& T,
+                          const Mat& d,
+                          const Mat& _I,
+                          const Mat& cameraMatrix,//Mat_<double>
+                          const Mat& _p,                //Mat_<double>
+                          int mode,
+                          float threshold,
+                          int numParams,
+                          LevelStats* stats
+                                      )
+{
+    Matx66d Hss;
+    Vec6d Je;
+    if(!normal_level_gray(T,d,_I,cameraMatrix,_p,mode,threshold,numParams,false,Hss,Je,stats))
+        return false;
+    applyStep(Hss,Je,numParams,false,_p);
     return true;
 }
+
+// The left compositional equations against two keyframes at once. _p is
+// relative to the first, pab is the first keyframe relative to the second
+// (LieSub(a.pose,b.pose)). Each keyframe's equations are weighted by
+// wa/wb, so the one that sees more of the frame dominates, and one losing
+// track only drops its share.
+bool Track::normal_level_joint_gray(const Mat& Ta,
+                                   const Mat& da,
+                                   double wa,
+                                   const Mat& Tb,
+                                   const Mat& db,
+                                   double wb,
+                                   const Mat& pab,
+                                   const Mat& _I,
+                                   const Mat& cameraMatrix,
+                                   const Mat& _p,
+                                   int mode,
+                                   float threshold,
+                                   Matx66d& H,
+                                   Vec6d& Je,
+                                   LevelStats* stats,
+                                   const Mat& gradTa,
+                                   const Mat& gradTb)
+{
+    Matx66d Ha,Hb;
+    Vec6d Ja,Jb;
+    bool a=normal_level_gray(Ta,da,_I,cameraMatrix,_p,mode,threshold,6,true,Ha,Ja,stats,gradTa);//stats are the first keyframe's
+    Vec6d pb=LieAdd(toLieVec(_p),toLieVec(pab));
+    bool b=normal_level_gray(Tb,db,_I,cameraMatrix,Mat(1,6,CV_64FC1,pb.val),mode,threshold,6,true,Hb,Jb,NULL,gradTb);
+    if(!a && !b)
+        return false;
+    H=Matx66d::zeros();
+    Je=Vec6d::all(0);
+    if(a){
+        H+=wa*Ha;
+        Je+=wa*Ja;
+    }
+    if(b){
+        H+=wb*Hb;
+        Je+=wb*Jb;
+    }
+    return true;
+}
+
+// Fraction of the keyframe's coarsest level that lands inside the current
+// frame at the current pose estimate, from geometry alone.
+double Track::predictOverlap(const Keyframe& kf){
+    return predictOverlap(kf.depthPyr[0],kf.cameraMatrixPyr[0],kf.pose);
+}
+
+double Track::predictOverlap(const Mat& d,const Mat& cameraMatrix,const Mat& _basePose){
+    const Matx44d K=make4x4(cameraMatrix);
+    Matx34d proj=paramsToProjection(LieSub(toLieVec(pose),toLieVec(_basePose)),K,cameraInverse(K));
+    int r=d.rows;
+    int c=d.cols;
+    int seen=0;
+    for(int i=0;i<r;i++){
+        const float* dp=d.ptr<float>(i);
+        for(int j=0;j<c;j++){
+            Vec3d x=proj*Vec4d(j,i,dp[j],1.0);
+            if(x[2]<=0)//behind the camera
+                continue;
+            double u=x[0]/x[2];
+            double v=x[1]/x[2];
+            seen+=(u>=0 && u<=c-1 && v>=0 && v<=r-1);
+        }
+    }
+    return seen/(double)(r*c);
+}
+
+double Track::residual_level_gray(const Mat& T,
+                                  const Mat& d,
+                                  const Mat& _I,
+                                  const Mat& cameraMatrix,
+                                  const Mat& _p)
+{
+    LevelSums sums;
+    levelSums(T,d,_I,cameraMatrix,toLieVec(_p),CV_DTAM_FWD,HUGE_VALF,0,false,Mat(),levelScratch(_I.size()),sums);
+    if(sums.valid<_I.rows*_I.cols*FAIL_FRACTION)
+        return HUGE_VAL;
+    return sums.absErr/sums.valid/intensityRange(_I.depth());
+}
+
+//Found by size, every pyramid level has its own
+LevelScratch& Track::levelScratch(const Size& size){
+    for(size_t l=0;l<scratch.size();l++){
+        if(scratch[l].size==size)
+            return scratch[l];
+    }
+    scratch.push_back(LevelScratch());
+    scratch.back().size=size;
+    return scratch.back();
+}
@@ -17,7 +17,6 @@ using namespace std;
 
 const static float FAIL_FRACTION=0.30;
 
-enum alignment_modes{CV_DTAM_REV,CV_DTAM_FWD,CV_DTAM_ESM};
 const double small0=.1;//~6deg, not trivial, but hopefully enough to make the translation matter
 
 static void getGradient(const Mat& image,Mat & grad);
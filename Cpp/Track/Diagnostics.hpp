@@ -0,0 +1,71 @@
+// Free for non-commercial, non-military, and non-critical
+// use unless incorporated in OpenCV.
+// Inherits OpenCV Licence if in OpenCV.
+
+#ifndef TRACK_DIAGNOSTICS_HPP
+#define TRACK_DIAGNOSTICS_HPP
+#include <vector>
+
+#define TRACK_MAX_LEVELS 8
+
+//Numbers from the last pass over one pyramid level
+struct LevelStats{
+    int pixels;      //0 if the level was not run
+    int valid;       //landed inside the image
+    int inliers;     //valid and within the matching threshold
+    double rms;      //residual RMS over the inliers, in [0,1] intensity units
+    double err;      //mean |T-I| over the valid pixels, as residual_level_gray() measures it
+    double condition;//Hessian condition number, large means a direction is unconstrained
+};
+
+//What one align() call saw. Cheap to copy, no heap.
+struct TrackDiagnostics{
+    int frame;          //count of align() calls
+    int keyframe;       //index in Track::keyframes, -1 if tracking the plain base
+    double overlap;     //predicted fraction of the base in view before aligning
+    bool skipped2D;     //the motion model's prediction was good enough
+    int iters;          //iterations in total, 2D and 3D
+    int finestLevel;    //finest level worked on, -1 if none
+    double inlierRatio; //inliers/pixels on the finest level
+    double condition;   //of the finest level's Hessian
+    bool failed;
+    double seconds;
+    LevelStats levels[TRACK_MAX_LEVELS];//coarse to fine
+
+    // Early warning: tracking still works but is losing support, time to
+    // bring in a new keyframe or cost volume before it fails outright.
+    bool weak(double minInlierRatio=.5,double minOverlap=.6) const{
+        return failed || inlierRatio<minInlierRatio || overlap<minOverlap;
+    }
+};
+
+// The last capacity diagnostics, newest first. Written by the tracking
+// thread only, readers elsewhere have to copy entries out under their
+// own lock.
+class TrackLog{
+public:
+    TrackLog(int capacity=256):entries(capacity),head(0),count(0){}
+    void push(const TrackDiagnostics& d){
+        entries[head]=d;
+        head=(head+1)%entries.size();
+        if(count<(int)entries.size())
+            count++;
+    }
+    int size() const{
+        return count;
+    }
+    //age 0 is the newest
+    const TrackDiagnostics& operator[](int age) const{
+        int n=entries.size();
+        return entries[((head-1-age)%n+n)%n];
+    }
+    void clear(){
+        head=count=0;
+    }
+private:
+    std::vector<TrackDiagnostics> entries;
+    int head;
+    int count;
+};
+
+#endif
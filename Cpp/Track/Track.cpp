@@ -1,7 +1,10 @@
 #include "Track.hpp"
 #include "utils/utils.hpp"
+#include <string.h>
 using namespace cv;
 using namespace std;
+#define LEVELS_2D 2
+
 Track::Track(Cost cost){
     rows=cost.rows;
     cols=cost.cols;
@@ -10,7 +13,7 @@ Track::Track(Cost cost){
     depth=cost.depthMap();
     PToLie(Mat(cost.pose),basePose);
     pose=basePose.clone();
-
+    init();
 }
 Track::Track(CostVolume cost){
     rows=cost.rows;
@@ -20,9 +23,59 @@ Track::Track(CostVolume cost){
     cameraMatrix=Mat(cost.cameraMatrix);
     RTToLie(cost.R,cost.T,basePose);
     pose=basePose.clone();
-
+    init();
+}
+Track::Track(const Mat& _baseImage, const Mat& _depth, const Mat& _cameraMatrix, const Mat& R, const Mat& T){
+    rows=_baseImage.rows;
+    cols=_baseImage.cols;
+    baseImage=lastFrame=thisFrame=_baseImage;
+    cameraMatrix=_cameraMatrix.clone();
+    depth=_depth;
+    RTToLie(R,T,basePose);
+    pose=basePose.clone();
+    init();
+}
+void Track::init(){
+    levels2D=LEVELS_2D;
+    maxIters=1;
+    stepTol=1e-5;
+    velocityDecay=1.0;
+    skip2DResidual=.03;
+    framePose=pose.clone();
+    lost=false;
+    maxKeyframes=3;
+    jointKeyframes=false;
+    activeKeyframe=secondKeyframe=-1;
+    frameCount=0;
+    memset(&diagnostics,0,sizeof(diagnostics));
+    diagnostics.keyframe=diagnostics.finestLevel=-1;
+}
+void Track::setPose(const cv::Mat& p){
+    p.copyTo(pose);
+    p.copyTo(framePose);
 }
 void Track::addFrame(cv::Mat frame){
     lastFrame=thisFrame;
+    std::swap(grayBuf[0],grayBuf[1]);
+    std::swap(inPyr,lfPyr);
+    if(!inPyr.empty())
+        inPyr.back().release();//a header onto the gray buffer about to be reused
+    if(frame.channels()!=1){
+        unshare(grayBuf[0]);
+        cvtColor(frame,grayBuf[0],cv::COLOR_BGR2GRAY);
+        frame=grayBuf[0];
+    }
     thisFrame=frame;
+    predictPose();
+}
+// Constant (velocityDecay=1) or decaying velocity in SE(3): the motion
+// from the second last frame to the last one is repeated, scaled along
+// its geodesic.
+void Track::predictPose(){
+    Vec6d current=toLieVec(pose);
+    Vec6d motion(0,0,0,0,0,0);
+    if(!lost && velocityDecay>0)
+        motion=LieScale(LieSub(current,toLieVec(framePose)),velocityDecay);
+    setLie(current,framePose);
+    setLie(LieAdd(motion,current),pose);
 }
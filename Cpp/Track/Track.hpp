@@ -4,11 +4,73 @@
 #include <CostVolume/Cost.h>
 #include <CostVolume/CostVolume.hpp>
 #include <DepthmapDenoiseWeightedHuber/DepthmapDenoiseWeightedHuber.hpp>
+#include <vector>
+#include <cmath>
+#include <string.h>
+#include "Diagnostics.hpp"
+
+enum alignment_modes{CV_DTAM_REV,CV_DTAM_FWD,CV_DTAM_ESM};
+
+//How far an alignment got before it returned
+struct AlignReport{
+    int level;      //finest pyramid level worked on, -1 if none
+    int iter;       //iterations finished on that level
+    int iters;      //iterations finished in total, 2D and 3D
+    bool complete;  //every level was run, not cut off by the deadline
+    bool failed;    //the finest level worked on lost track (too little overlap)
+    double seconds;
+};
+
+//A keyframe of the tracking window, its pyramids are built once when it is added
+struct Keyframe{
+    cv::Mat image;//gray
+    cv::Mat depth;
+    cv::Mat pose;//Lie parameters
+    std::vector<cv::Mat> imagePyr;
+    std::vector<cv::Mat> depthPyr;
+    std::vector<cv::Mat> cameraMatrixPyr;
+    std::vector<cv::Mat> gradPyr;//ESM template gradients of imagePyr, built on first use
+    double overlap;//predicted fraction of it in view at the last selectKeyframe()
+};
+
+//What one pass over a level adds up
+struct LevelSums{
+    double H[6][6];//lower triangle only
+    double Je[6];
+    int valid;    //pixels that land in the image
+    int inliers;  //valid and within threshold, the ones the equations use
+    double absErr;//sum |T-I| over valid
+    double sqErr; //sum (T-I)^2 over inliers
+    void clear(){
+        memset(this,0,sizeof(*this));
+    }
+    void add(const LevelSums& o){
+        for(int a=0;a<6;a++){
+            for(int b=0;b<=a;b++)
+                H[a][b]+=o.H[a][b];
+            Je[a]+=o.Je[a];
+        }
+        valid+=o.valid;
+        inliers+=o.inliers;
+        absErr+=o.absErr;
+        sqErr+=o.sqErr;
+    }
+};
+
+//Buffers of a pyramid level's passes, allocated on its first pass and reused
+struct LevelScratch{
+    cv::Size size;
+    cv::Mat gradI;
+    cv::Mat gradT;//ESM and the rotation pre-alignment only
+    std::vector<LevelSums> stripes;//per stripe sums, added up afterwards
+};
 
 class Track{
+    friend struct TrackBench;//bench/kernels.cpp times single levels
 public:
     void align();
-    void align_gray(cv::Mat& base, cv::Mat& depth, cv::Mat& input);
+    AlignReport align(double budget);//returns the best pose reachable within budget seconds
+    AlignReport align_gray(cv::Mat& base, cv::Mat& depth, cv::Mat& input, double budget=HUGE_VAL);
     cv::Mat cameraMatrix;
     int rows;
     int cols;
@@ -21,13 +83,61 @@ public:
     cv::Mat thisFrame;
     cv::Mat lastFrame;
     
+    std::vector<int> levelModes;//alignment mode for each pyramid level (coarse to fine), CV_DTAM_FWD if not given
+    int levels2D;//number of coarse levels of rotation only pre-alignment against lastFrame
+    int maxIters;//iterations per level (default 1), fewer if a step stops improving, gets below stepTol or time runs short
+    double stepTol;//norm of the Lie parameter update that counts as converged
+    double velocityDecay;//motion model: a new frame is predicted to repeat velocityDecay times the last frame's motion, 0 starts from the last pose
+    double skip2DResidual;//skip the 2D pre-alignment if the predicted pose's mean residual on the coarsest level is below this, 0 never skips
+    
+    //Keyframe window. While it is empty only baseImage/depth/basePose are tracked against.
+    std::vector<Keyframe> keyframes;
+    int maxKeyframes;//window size, the keyframe overlapping the current frame least is dropped first
+    bool jointKeyframes;//also weight in the residuals of the second best keyframe
+    int addKeyframe(const cv::Mat& image, const cv::Mat& depth, const cv::Mat& R, const cv::Mat& T);
+    int selectKeyframe();//makes the keyframe with the best predicted overlap the base, returns its index
+    
+    TrackDiagnostics diagnostics;//of the last align()
+    TrackLog diagLog;//the recent diagnostics
+    
     Track(Cost cost);
     Track(CostVolume cost);
+    Track(const cv::Mat& baseImage, const cv::Mat& depth, const cv::Mat& cameraMatrix, const cv::Mat& R, const cv::Mat& T);
     void addFrame(cv::Mat frame);
+    void setPose(const cv::Mat& p);//jumps to p, the motion model restarts from it
     void ESM();
     void cacheDerivatives();
 
 private:
+    void init();
+    
+    //Deadline bookkeeping
+    std::vector<double> iterCost;//running average seconds per iteration at each level
+    double predictIterCost(int level);
+    void recordIterCost(int level,double seconds);
+    
+    //Motion model
+    cv::Mat framePose;//pose of lastFrame, the prediction extrapolates from it
+    bool lost;//the last alignment failed, so its motion is not to be trusted
+    void predictPose();
+    
+    //Keyframe window
+    Keyframe baseKf;//pyramids of a base that is not in the window
+    Keyframe& baseKeyframe(const cv::Mat& base, const cv::Mat& depth);
+    int activeKeyframe;//index of the keyframe that is the base, -1 if none
+    int secondKeyframe;//next best for joint alignment, -1 if none
+    double predictOverlap(const Keyframe& kf);
+    double predictOverlap(const cv::Mat& depth, const cv::Mat& cameraMatrix, const cv::Mat& _basePose);
+    
+    int frameCount;
+    
+    //Per frame buffers, swapped by addFrame() and reused once nothing else holds them
+    cv::Mat grayBuf[2];//gray thisFrame and lastFrame, for frames that came in color
+    std::vector<cv::Mat> inPyr;//pyramid of thisFrame, built by align_gray()
+    std::vector<cv::Mat> lfPyr;//of lastFrame, the previous inPyr if it was aligned
+    std::vector<LevelScratch> scratch;//one per pyramid level size, see levelScratch()
+    LevelScratch& levelScratch(const cv::Size& size);
+    
     //Alignment Functions
     
     //Large deformation, forward mapping, 6DoF
@@ -38,7 +148,51 @@ private:
                                            const cv::Mat& _p,                //Mat_<double>
                                            int mode,
                                            float threshold,
-                                           int numParams);
+                                           int numParams,
+                                           LevelStats* stats=NULL);
+    //Small scaled normal equations of a level, optionally for a left compositional update
+    bool normal_level_gray(const cv::Mat& T,
+                           const cv::Mat& d,
+                           const cv::Mat& _I,
+                           const cv::Mat& cameraMatrix,
+                           const cv::Mat& _p,
+                           int mode,
+                           float threshold,
+                           int numParams,
+                           bool compositional,
+                           cv::Matx66d& Hss,
+                           cv::Vec6d& Je,
+                           LevelStats* stats=NULL,
+                           const cv::Mat& gradT=cv::Mat());//T's ESM gradient if cached, else computed
+    //Two keyframes, residuals weighted by wa and wb, summed left compositional equations
+    bool normal_level_joint_gray(const cv::Mat& Ta,
+                                const cv::Mat& da,
+                                double wa,
+                                const cv::Mat& Tb,
+                                const cv::Mat& db,
+                                double wb,
+                                const cv::Mat& pab,
+                                const cv::Mat& _I,
+                                const cv::Mat& cameraMatrix,
+                                const cv::Mat& _p,
+                                int mode,
+                                float threshold,
+                                cv::Matx66d& H,
+                                cv::Vec6d& Je,
+                                LevelStats* stats=NULL,
+                                const cv::Mat& gradTa=cv::Mat(),
+                                const cv::Mat& gradTb=cv::Mat());
+    //Rotation only ESM against T on a small level, returns the iterations used
+    int align_rotation_level(const cv::Mat& T,
+                             const cv::Mat& _I,
+                             const cv::Mat& cameraMatrix,
+                             cv::Matx33d& R);
+    //Mean absolute error of T against _I pulled back through _p, HUGE_VAL if they barely overlap
+    double residual_level_gray(const cv::Mat& T,
+                               const cv::Mat& d,
+                               const cv::Mat& _I,
+                               const cv::Mat& cameraMatrix,
+                               const cv::Mat& _p);
     
 };
 
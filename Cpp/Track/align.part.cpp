@@ -10,7 +10,7 @@
 
 #include "Track.hpp"
 #include "Align_part.cpp"
-#include "tictoc.h"
+#include "utils/Profiler.hpp"
 #include <opencv2/opencv.hpp>
 #include <vector>
 #include <algorithm>
@@ -52,7 +52,8 @@
 //
 using namespace cv;
 using namespace std;
-#define LEVELS_2D 2
+
+static const int TRACK_LEVELS=6; // 6 levels on a 640x480 image is 20x15
 
 void createPyramid(const Mat& image,vector<Mat>& pyramid,int& levels){
     
@@ -66,32 +67,17 @@ void createPyramid(const Mat& image,vector<Mat>& pyramid,int& levels){
     pyramid[l2--]=in;
     
     for (float scale=0.5; l2>=0; scale/=2, l2--) {
-        Mat out;
-
-        
+        Mat& out=pyramid[l2];
+        unshare(out);//a pyramid passed in again is rebuilt in its own buffers
         resize(in,out,Size(),.5,.5,cv::INTER_AREA);
-        pyramid[l2]=out;
         in=out;
     }
     
 }
 
-static void createPyramids(const Mat& base,
-                           const Mat& depth,
-                           const Mat& input,
-                           const Mat& cameraMatrixIn,
-                           vector<Mat>& basePyr,
-                           vector<Mat>& depthPyr,
-                           vector<Mat>& inPyr,
-                           vector<Mat>& cameraMatrixPyr,
-                           int& levels
-){
-    createPyramid(base,basePyr,levels);
-    createPyramid(depth,depthPyr,levels);
-    createPyramid(input,inPyr,levels);
-    int l2=0;
+// Camera matrices for each level, see the bottom of this file for the form
+static void createCameraPyramid(const Mat& cameraMatrixIn,vector<Mat>& cameraMatrixPyr,int levels){
     cameraMatrixPyr.resize(levels);
-    // Figure out camera matrices for each level
     for (double scale=1.0,l2=levels-1; l2>=0; scale/=2, l2--) {
         Mat cameraMatrix=make4x4(cameraMatrixIn.clone());
         cameraMatrix(Range(0,2),Range(2,3))+=.5;
@@ -99,86 +85,314 @@ static void createPyramids(const Mat& base,
         cameraMatrix(Range(0,2),Range(2,3))-=.5;
         cameraMatrixPyr[l2]=cameraMatrix;
     }
-    
 }
+
+// 8 and 16 bit input is tracked as is, an image pyramid of another type
+// is brought to it in place (float images are taken to be in [0,1]).
+// Kept pyramids are converted once, not on every alignment.
+static void convertPyramid(vector<Mat>& pyr,int depth){
+    if(pyr.empty() || pyr[0].depth()==depth)
+        return;
+    for (size_t l=0; l<pyr.size(); l++)
+        pyr[l].convertTo(pyr[l],depth,intensityRange(depth)/intensityRange(pyr[l].depth()));
+}
+
+// A keyframe's ESM template gradient at a level, of its imagePyr in the
+// depth tracked in. Built on first use and kept, so a keyframe's
+// gradients are computed once rather than on every pass.
+static const Mat& keyframeGradient(Keyframe& kf,int level){
+    if(kf.gradPyr.size()!=kf.imagePyr.size())
+        kf.gradPyr.resize(kf.imagePyr.size());
+    Mat& grad=kf.gradPyr[level];
+    const Mat& base=kf.imagePyr[level];
+    if(grad.empty() || grad.depth()!=gradientDepth(base.depth()))//first use, or the input depth changed
+        imageGradient(base,grad);
+    return grad;
+}
+
 void Track::align(){
-    align_gray(baseImage, depth, thisFrame);
+    align(HUGE_VAL);
 };
 
-void Track::align_gray(Mat& _base, Mat& depth, Mat& _input){
+AlignReport Track::align(double budget){
+    if(!keyframes.empty())
+        selectKeyframe();
+    return align_gray(baseImage, depth, thisFrame, budget);
+}
+
+int Track::addKeyframe(const Mat& image, const Mat& _depth, const Mat& R, const Mat& T){
+    Keyframe kf;
+    kf.image=image;
+    makeGray(kf.image);
+    kf.depth=_depth;
+    RTToLie(R,T,kf.pose);
+    int levels=TRACK_LEVELS;
+    createPyramid(kf.image,kf.imagePyr,levels);
+    createPyramid(kf.depth,kf.depthPyr,levels);
+    createCameraPyramid(cameraMatrix,kf.cameraMatrixPyr,levels);
+    kf.overlap=1.0;
+    
+    if((int)keyframes.size()>=maxKeyframes && !keyframes.empty()){
+        int worst=0;
+        for(size_t k=0;k<keyframes.size();k++){
+            keyframes[k].overlap=predictOverlap(keyframes[k]);
+            if(keyframes[k].overlap<keyframes[worst].overlap)
+                worst=k;
+        }
+        keyframes.erase(keyframes.begin()+worst);
+    }
+    keyframes.push_back(kf);
+    activeKeyframe=secondKeyframe=-1;//indices moved, selectKeyframe() sets them again
+    return keyframes.size()-1;
+}
+
+// Pyramids of a base that is not in the keyframe window (the baseImage
+// and depth a Track was made with), rebuilt only when either changes
+Keyframe& Track::baseKeyframe(const Mat& base,const Mat& _depth){
+    if(baseKf.imagePyr.empty() || baseKf.image.data!=base.data || baseKf.depth.data!=_depth.data){
+        int levels=TRACK_LEVELS;
+        baseKf.image=base;
+        baseKf.depth=_depth;
+        createPyramid(base,baseKf.imagePyr,levels);
+        createPyramid(_depth,baseKf.depthPyr,levels);
+        createCameraPyramid(cameraMatrix,baseKf.cameraMatrixPyr,levels);
+        baseKf.gradPyr.clear();
+        baseKf.overlap=1.0;
+    }
+    return baseKf;
+}
+
+int Track::selectKeyframe(){
+    activeKeyframe=secondKeyframe=-1;
+    for(int k=0;k<(int)keyframes.size();k++){
+        keyframes[k].overlap=predictOverlap(keyframes[k]);
+        if(activeKeyframe<0 || keyframes[k].overlap>keyframes[activeKeyframe].overlap){
+            secondKeyframe=activeKeyframe;
+            activeKeyframe=k;
+        }else if(secondKeyframe<0 || keyframes[k].overlap>keyframes[secondKeyframe].overlap){
+            secondKeyframe=k;
+        }
+    }
+    if(activeKeyframe<0)
+        return -1;
+    if(secondKeyframe>=0 && keyframes[secondKeyframe].overlap<FAIL_FRACTION)
+        secondKeyframe=-1;//would just fail
+    const Keyframe& kf=keyframes[activeKeyframe];
+    baseImage=kf.image;
+    depth=kf.depth;
+    basePose=kf.pose;
+    return activeKeyframe;
+}
+
+// Predicted seconds for one iteration at a level. Levels not seen yet
+// are guessed from the next coarser level, which has a quarter the pixels.
+double Track::predictIterCost(int level){
+    if(level<(int)iterCost.size() && iterCost[level]>0)
+        return iterCost[level];
+    if(level>0)
+        return 4*predictIterCost(level-1);
+    return 0;
+}
+
+void Track::recordIterCost(int level,double seconds){
+    if((int)iterCost.size()<=level)
+        iterCost.resize(level+1,0.0);
+    iterCost[level]= iterCost[level]>0 ? .7*iterCost[level]+.3*seconds : seconds;
+}
+
+AlignReport Track::align_gray(Mat& _base, Mat& depth, Mat& _input, double budget){
     Mat input,base,lastFrameGray;
     input=makeGray(_input);
     base=makeGray(_base);
     lastFrameGray=makeGray(lastFrame)  ;
     
-    tic();
-    int levels=6; // 6 levels on a 640x480 image is 20x15
+    PROFILE_ZONE("align_gray");
+    Profiler::Stopwatch clock;
+    int levels=TRACK_LEVELS;
     int startlevel=0;
     int endlevel=6;
-
-    Mat p=LieSub(pose,basePose);// the Lie parameters 
-    cout<<"pose: "<<p<<endl;
-
-    vector<Mat> basePyr,depthPyr,inPyr,cameraMatrixPyr;
-    createPyramids(base,depth,input,cameraMatrix,basePyr,depthPyr,inPyr,cameraMatrixPyr,levels);
-    
-    vector<Mat> lfPyr;
-    createPyramid(lastFrameGray,lfPyr,levels);
+    AlignReport report={-1,0,0,false,false,0.0};
+
+    // The Lie parameters. p, pab and before are headers over these, so a
+    // frame's pose arithmetic stays off the heap.
+    Vec6d pv=LieSub(toLieVec(pose),toLieVec(basePose)),pabv,beforev;
+    Mat p(1,6,CV_64FC1,pv.val);
+
+    // Keyframes keep their pyramids, a base that is not one keeps them in
+    // baseKf. Either is brought to the input's depth once.
+    Keyframe* kf=NULL;
+    for(size_t k=0;k<keyframes.size();k++){
+        if(keyframes[k].image.data==base.data && keyframes[k].depth.data==depth.data)
+            kf=&keyframes[k];
+    }
+    Keyframe& src= kf ? *kf : baseKeyframe(base,depth);
+    createPyramid(input,inPyr,levels);
+    int workDepth=inPyr[0].depth();
+    convertPyramid(src.imagePyr,workDepth);
+    const vector<Mat>& basePyr=src.imagePyr;
+    const vector<Mat>& depthPyr=src.depthPyr;
+    const vector<Mat>& cameraMatrixPyr=src.cameraMatrixPyr;
+    Keyframe* kf2=NULL;
+    Mat pab(1,6,CV_64FC1,pabv.val);
+    if(kf && jointKeyframes && activeKeyframe>=0 && secondKeyframe>=0 && kf==&keyframes[activeKeyframe]){
+        kf2=&keyframes[secondKeyframe];
+        convertPyramid(kf2->imagePyr,workDepth);
+        pabv=LieSub(toLieVec(kf->pose),toLieVec(kf2->pose));
+    }
+    TrackDiagnostics diag;
+    memset(&diag,0,sizeof(diag));
+    diag.frame=frameCount++;
+    diag.keyframe=kf ? (int)(kf-&keyframes[0]) : -1;
+    diag.overlap=kf ? kf->overlap : predictOverlap(depthPyr[0],cameraMatrixPyr[0],basePose);
+    assert(levels<=TRACK_MAX_LEVELS);
     
+    if(lastFrameGray.data==base.data){//the first lastFrame is the base image, already converted
+        lfPyr=basePyr;
+    }else if((int)lfPyr.size()!=levels || lfPyr[levels-1].data!=lastFrameGray.data){//not aligned last frame
+        createPyramid(lastFrameGray,lfPyr,levels);
+        convertPyramid(lfPyr,workDepth);
+    }
     
-
-
+    // Time left must cover one iteration on every level still to come,
+    // extra iterations on a level are only taken out of the slack.
+    // Running out of time on a level's first iteration ends the alignment,
+    // the pose from the coarser levels is returned instead.
+    double reserve3D=0;
+    for (int l=startlevel; l<levels && l<endlevel; l++)
+        reserve3D+=predictIterCost(l);
     
+    // The 2D pre-alignment is only there to get the 3D stage into its
+    // basin, so it is skipped if the motion model already did that.
     int level=startlevel;
-    Mat p2d=Mat::zeros(1,6,CV_64FC1);
-    for (; level<LEVELS_2D; level++){
-        int iters=1;
-        for(int i=0;i<iters;i++){
-            //HACK: use 3d alignment with depth disabled for 2D. ESM would be much better, but I'm lazy right now.
-            align_level_largedef_gray_forward(  lfPyr[level],//Total Mem cost ~185 load/stores of image
-                                                depthPyr[level]*0.0,
-                                                inPyr[level],
-                                                cameraMatrixPyr[level],//Mat_<double>
-                                                p2d,                //Mat_<double>
-                                                CV_DTAM_FWD,
-                                                1,
-                                                3);
-//             if(tocq()>.01)
-//                 break;
+    int end2D=levels2D;
+    if(levels2D>0 && skip2DResidual>0 &&
+       residual_level_gray(basePyr[0],depthPyr[0],inPyr[0],cameraMatrixPyr[0],p)<skip2DResidual){
+        end2D=0;
+    }
+    diag.skipped2D=levels2D>0 && end2D==0;
+    // Rotation only pre-alignment against lastFrame, starting from the
+    // rotation of the predicted motion. It costs microseconds on these
+    // levels, so it only stops if the deadline has already passed.
+    if(end2D>0){
+        Vec6d m=LieSub(toLieVec(pose),toLieVec(framePose));//the predicted motion since lastFrame
+        Matx33d R2d=SO3::exp(Vec3d(m[0],m[1],m[2])).R;
+        for (; level<end2D && clock.seconds()<budget; level++){
+            PROFILE_ZONE("rotation level");
+            report.iters+=align_rotation_level(lfPyr[level],inPyr[level],cameraMatrixPyr[level],R2d);
         }
+        Vec3d w=SO3(R2d).log();
+        m[0]=w[0];
+        m[1]=w[1];
+        m[2]=w[2];
+        pv=LieAdd(m,LieSub(toLieVec(framePose),toLieVec(basePose)));
     }
-    p=LieAdd(p2d,p);
 //     cout<<"3D iteration:"<<endl;
+    // Each pass measures the residual at the pose it starts from, so it
+    // also judges the step before it: a step that did not lower the
+    // residual is undone and the level is done. The last step on a level
+    // is kept unjudged, checking it would take a pass of its own. failed
+    // is the last level's: a coarse level losing track is not fatal if a
+    // finer one picks it up again.
+    Mat before(1,6,CV_64FC1,beforev.val);
+    Matx66d H;
+    Vec6d Je;
     for (level=startlevel; level<levels && level<endlevel; level++){
-        int iters=1;
-        for(int i=0;i<iters;i++){
+        int mode=level<(int)levelModes.size() ? levelModes[level] : CV_DTAM_FWD;
+        double cost=predictIterCost(level);
+        reserve3D-=cost;
+        Mat gradT,gradT2;//the bases' cached ESM gradients
+        if(mode==CV_DTAM_ESM){
+            gradT=keyframeGradient(src,level);
+            if(kf2)
+                gradT2=keyframeGradient(*kf2,level);
+        }
+        int i=0;
+        for(;i<maxIters;i++){
+            double left=budget-clock.seconds();
+            if(i==0 && cost>left)
+                goto loopend;//olny sactioned use of goto, the double break
+            if(i>0 && cost+reserve3D>left)
+                break;
+            PROFILE_ZONE("iteration");
+            double t0=clock.seconds();
             float thr = (levels-level)>=2 ? .05 : .2; //more stringent matching on last two levels 
-            bool improved;
-            improved = align_level_largedef_gray_forward(   basePyr[level],//Total Mem cost ~185 load/stores of image
-                                                            depthPyr[level],
-                                                            inPyr[level],
-                                                            cameraMatrixPyr[level],//Mat_<double>
-                                                            p,                //Mat_<double>
-                                                            CV_DTAM_FWD,
-                                                            thr,
-                                                            6);
-            
-//             if(tocq()>.5){
-//                 cout<<"completed up to level: "<<level-startlevel+1<<"   iter: "<<i+1<<endl;
-//                 goto loopend;//olny sactioned use of goto, the double break
-//             }
-//             if(!improved){
-//                 break;
-//             }
+            LevelStats pass;
+            bool tracked;
+            if(kf2){
+                tracked = normal_level_joint_gray(  basePyr[level],
+                                                    depthPyr[level],
+                                                    kf->overlap,
+                                                    kf2->imagePyr[level],
+                                                    kf2->depthPyr[level],
+                                                    kf2->overlap,
+                                                    pab,
+                                                    inPyr[level],
+                                                    cameraMatrixPyr[level],
+                                                    p,
+                                                    mode,
+                                                    thr,
+                                                    H,
+                                                    Je,
+                                                    &pass,
+                                                    gradT,
+                                                    gradT2);
+            }else{
+                tracked = normal_level_gray(    basePyr[level],//Total Mem cost ~185 load/stores of image
+                                                depthPyr[level],
+                                                inPyr[level],
+                                                cameraMatrixPyr[level],//Mat_<double>
+                                                p,                //Mat_<double>
+                                                mode,
+                                                thr,
+                                                6,
+                                                false,
+                                                H,
+                                                Je,
+                                                &pass,
+                                                gradT);
+            }
+            recordIterCost(level,clock.seconds()-t0);
+            report.iters++;
+            if(i>0 && !(tracked && pass.err<diag.levels[level].err)){//the last step made it worse
+                before.copyTo(p);
+                report.failed=false;//before was tracked
+                break;
+            }
+            diag.levels[level]=pass;
+            report.failed=!tracked;
+            if(!tracked)
+                break;
+            p.copyTo(before);
+            applyStep(H,Je,6,kf2!=NULL,p);
+            if(norm(p,before)<stepTol){
+                i++;
+                break;
+            }
         }
+        report.level=level;
+        report.iter=i;
     }
+    report.complete=true;
     loopend:
+    lost=report.failed;
     
-    pose=LieAdd(p,basePose);
+    setLie(LieAdd(pv,toLieVec(basePose)),pose);
     static int runs=0;
     //assert(runs++<2);
-    toc();
+    report.seconds=clock.seconds();
     
+    diag.iters=report.iters;
+    diag.finestLevel=report.level;
+    diag.failed=report.failed;
+    diag.seconds=report.seconds;
+    if(report.level>=0){
+        const LevelStats& ls=diag.levels[report.level];
+        diag.inlierRatio=ls.pixels ? (double)ls.inliers/ls.pixels : 0;
+        diag.condition=ls.condition;
+    }
+    diagnostics=diag;
+    diagLog.push(diag);
+    return report;
 }
 
 // See reprojectCloud.cpp for explanation of the form 
@@ -211,53 +425,13 @@ void Track::align_gray(Mat& _base, Mat& depth, Mat& _input){
 
 
 
+// ESM on every level, as the paper does for the initial alignment.
+// The per level choice is in levelModes, this is the all-ESM shortcut.
 void Track::ESM(){
-
-//     
-//     //Build map differentials:
-//     {
-//         //build identity map
-//         Mat_<Vec3f> xyin(im.rows,im.cols);
-//         float* pt=(float*) (xyin.data);
-//         float* d=(float*) (depth.data);
-//         for(int i=0;i<im.rows;i++){
-//             for(int j=0;j<im.cols;j++,pt+=3,d++){
-//                 pt[0]=j;
-//                 pt[1]=i;
-//                 pt[2]=*d;
-//             }
-//         }
-//         for (i=0; i<numDF; i++) {
-//             //build slightly perturbed matrix
-//             double small=1e-6;
-//             Mat_<double> ptemp=p.clone();
-//             ptemp(0,i)+=small;
-//             Mat dR=rodrigues(ptemp(0,Range(0,3)));
-//             Mat dT=ptemp(0,Range(3,6));
-//             Mat dA;
-//             hconcat(dR,dT,dA);
-//             dA=make4x4(dA);
-//             
-//             float* pt=(float*) (xyin.data);
-//             float* d=(float*) (depth.data);
-//             for(int i=0;i<im.rows;i++){
-//                 for(int j=0;j<im.cols;j++,pt+=3,d++){
-//                     pt[0]=j;
-//                     pt[1]=i;
-//                     pt[2]=*d;
-//                 }
-//             } 
-//         }
-//     }
-//     
-//     for (int i=0;i<iters;i++) {
-//         
-//         p=ESMStep();
-//     }
-// 
-    
-    
-    
+    vector<int> modes=levelModes;
+    levelModes.assign(6,CV_DTAM_ESM);
+    align();
+    levelModes=modes;
 }
 
 
@@ -0,0 +1,273 @@
+// Free for non-commercial, non-military, and non-critical
+// use unless incorporated in OpenCV.
+// Inherits OpenCV Licence if in OpenCV.
+
+// Runs the whole OpenDTAM pipeline (cost accumulation, optimization,
+// tracking) on the synthetic scene and scores it against the truth, so no
+// dataset is needed.
+//
+// The first frames are given their true poses, they seed the first cost
+// volume. Once it is optimized the rest are tracked in lock step: a frame
+// is added, and the next is only rendered after it came out of
+// popTracked. Reported:
+//   fps          tracked frames per second of add-to-pop time
+//   latency      add-to-pop per frame, mean and percentiles
+//   stages       the profiler zones (align_gray, updateCostL1, optimizeQD,
+//                optimizeA, ...), empty in a build without DTAM_PROFILE
+//   depth        RMSE of every finished depth map against the plane's
+//                true inverse depth at that frame's true pose
+//   ATE          RMSE of the tracked camera centres, no alignment needed
+//                as the seeded poses fix the frame and the scale
+//   RPE          frame to frame relative pose error, translation RMSE
+//                and mean rotation
+//
+// The cost volume spans inverse depths 0 to COST_H_DEFAULT_NEAR, so the
+// scene is scaled up until the plane sits in the middle of that range.
+// The rendered images are the same at any scale.
+//
+// The table goes to stderr, a JSON document to stdout:
+//   benchEndToEnd > endToEnd.json
+//
+// usage: benchEndToEnd [--frames n] [--seeds n] [--size cols rows] [--layers n]
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <iostream>
+#include <streambuf>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "OpenDTAM.hpp"
+#include "utils/utils.hpp"
+#include "utils/Profiler.hpp"
+#include "synthScene.hpp"
+
+using namespace cv;
+using namespace std;
+
+static const double sceneScale=COST_H_DEFAULT_NEAR/(2*synthPlane()[2]);//inverse depth multiplier
+
+struct TruePose{
+    Mat R,T;//world -> camera, scaled scene
+};
+
+static TruePose truePose(int k){
+    TruePose t;
+    LieToRT(synthTrajectory(k),t.R,t.T);
+    t.T/=sceneScale;
+    return t;
+}
+
+//camera -> world, 4x4
+static Mat cameraToWorld(const Mat& R,const Mat& T){
+    Mat P=Mat::eye(4,4,CV_64FC1);
+    Mat Rt=R.t();
+    Rt.copyTo(P(Range(0,3),Range(0,3)));
+    Mat C=-Rt*T;
+    C.copyTo(P(Range(0,3),Range(3,4)));
+    return P;
+}
+
+static double rotationAngle(const Mat& P){
+    double c=(trace(P(Range(0,3),Range(0,3)))[0]-1)/2;
+    return acos(std::max(-1.0,std::min(1.0,c)));
+}
+
+//The plane n'X=1 (base camera, unscaled) seen from frame k, as inverse depth in the scaled scene
+static Mat trueInverseDepth(int k,int rows,int cols,const Mat& cameraMatrix){
+    Mat R,T;
+    LieToRT(synthTrajectory(k),R,T);
+    Vec3d n=synthPlane();
+    Mat nm(n);
+    Mat Rn=R*nm;
+    double off=1+nm.dot(R.t()*T);//n'X_world=1 with X_world=R'(X-T)
+    Vec3d nk(Rn.at<double>(0)/off,Rn.at<double>(1)/off,Rn.at<double>(2)/off);
+    return synthDepth(rows,cols,cameraMatrix,nk)*sceneScale;
+}
+
+static Mat renderFrame(const Mat& tex,const Mat& cameraMatrix,int k){
+    Mat view=synthView(tex,cameraMatrix,synthTrajectory(k));
+    Mat bgr;
+    cvtColor(view,bgr,cv::COLOR_GRAY2BGR);
+    return bgr;
+}
+
+//The pipeline reports thread starts and stops and lost frames on cout,
+// stdout is for the JSON
+struct NullBuf : public streambuf{
+    int overflow(int c){
+        return c;
+    }
+};
+
+static double percentile(vector<double> v,double q){
+    if(v.empty())
+        return 0;
+    sort(v.begin(),v.end());
+    return v[std::min(v.size()-1,(size_t)(q*v.size()))];
+}
+
+int main(int argc,char** argv){
+    int frames=60;
+    int seeds=4;
+    int rows=240,cols=320;
+    int layers=32;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"--frames") && i+1<argc){
+            frames=atoi(argv[++i]);
+        }else if(!strcmp(argv[i],"--seeds") && i+1<argc){
+            seeds=atoi(argv[++i]);
+        }else if(!strcmp(argv[i],"--size") && i+2<argc){
+            cols=atoi(argv[++i]);
+            rows=atoi(argv[++i]);
+        }else if(!strcmp(argv[i],"--layers") && i+1<argc){
+            layers=atoi(argv[++i]);
+        }else{
+            fprintf(stderr,"usage: %s [--frames n] [--seeds n] [--size cols rows] [--layers n]\n",argv[0]);
+            return 1;
+        }
+    }
+    if(seeds<2 || frames<=seeds){
+        fprintf(stderr,"need at least 2 seed frames and more frames than seeds\n");
+        return 1;
+    }
+
+    Mat cameraMatrix=synthCameraMatrix(rows,cols);
+    Mat tex=synthTexture(rows,cols);
+
+    vector<Ptr<Frame> > keep;//every frame, the depth maps are filled in on them later
+    vector<double> latency;
+    vector<int> trackedIds;
+    vector<Mat> trackedPoses;//camera -> world, estimated
+    int lost=0;
+    double mapSeconds=0,wall=0;
+    NullBuf null;
+    streambuf* out=cout.rdbuf(&null);
+    {
+        OpenDTAM odm(cameraMatrix);
+        odm.layers=layers;
+        odm.maxFrames=0;//keep holds on to every frame
+
+        Profiler::Stopwatch mapClock;
+        for(int k=0;k<seeds;k++){
+            TruePose t=truePose(k);
+            odm.addFrameWithPose(renderFrame(tex,cameraMatrix,k),t.R,t.T);
+            keep.push_back(odm.popTracked());
+        }
+        odm.seedDone();//the first map is built from all of them
+        while(odm.mapsBuilt()==0)//tracking needs the first depth map
+            usleep(1000);
+        mapSeconds=mapClock.seconds();
+        Profiler::reset();//the stages from here on are the steady state
+
+        for(int k=seeds;k<frames;k++){
+            Mat image=renderFrame(tex,cameraMatrix,k);
+            Profiler::Stopwatch frameClock;
+            odm.addFrame(image);
+            Ptr<Frame> f=odm.popTracked();
+            double s=frameClock.seconds();
+            if(f.empty())
+                break;
+            latency.push_back(s);
+            wall+=s;
+            keep.push_back(f);
+            if(!f->reg3d){
+                lost++;
+                continue;
+            }
+            trackedIds.push_back(f->fid);
+            trackedPoses.push_back(cameraToWorld(f->R,f->T));
+        }
+    }//stops the pipeline, the depth maps are final after this
+    cout.rdbuf(out);
+
+    //pose errors
+    double ate=0;
+    for(size_t i=0;i<trackedIds.size();i++){
+        TruePose t=truePose(trackedIds[i]);
+        Mat d=trackedPoses[i].col(3).rowRange(0,3)-cameraToWorld(t.R,t.T).col(3).rowRange(0,3);
+        ate+=d.dot(d);
+    }
+    ate=trackedIds.empty() ? 0 : sqrt(ate/trackedIds.size());
+    double rpeT=0,rpeR=0;
+    int pairs=0;
+    for(size_t i=0;i+1<trackedIds.size();i++){
+        if(trackedIds[i+1]!=trackedIds[i]+1)
+            continue;
+        TruePose a=truePose(trackedIds[i]),b=truePose(trackedIds[i+1]);
+        Mat truth=cameraToWorld(a.R,a.T).inv()*cameraToWorld(b.R,b.T);
+        Mat est=trackedPoses[i].inv()*trackedPoses[i+1];
+        Mat err=truth.inv()*est;
+        Mat e=err.col(3).rowRange(0,3);
+        rpeT+=e.dot(e);
+        rpeR+=rotationAngle(err);
+        pairs++;
+    }
+    if(pairs){
+        rpeT=sqrt(rpeT/pairs);
+        rpeR=rpeR/pairs*180/CV_PI;
+    }
+
+    //depth errors
+    vector<int> mapIds;
+    vector<double> mapRmse,mapRel;
+    for(size_t i=0;i<keep.size();i++){
+        const Frame& f=*keep[i];
+        if(f.depth.empty())
+            continue;
+        Mat truth=trueInverseDepth(f.fid,rows,cols,cameraMatrix);
+        Mat est;
+        f.depth.convertTo(est,CV_64FC1);
+        truth.convertTo(truth,CV_64FC1);
+        Mat d=est-truth;
+        double rmse=sqrt(d.dot(d)/d.total());
+        mapIds.push_back(f.fid);
+        mapRmse.push_back(rmse);
+        mapRel.push_back(rmse/mean(truth)[0]);
+    }
+
+    vector<Profiler::ZoneStats> zones=Profiler::snapshot();
+    int tracked=trackedIds.size();
+    double fps=wall>0 ? latency.size()/wall : 0;
+    double meanLatency=latency.empty() ? 0 : wall/latency.size();
+
+    fprintf(stderr,"\n%d frames at %dx%d, %d layers, %d seeded\n",frames,cols,rows,layers,seeds);
+    fprintf(stderr,"first map    %.2f s\n",mapSeconds);
+    fprintf(stderr,"tracked      %d, lost %d\n",tracked,lost);
+    fprintf(stderr,"fps          %.2f\n",fps);
+    fprintf(stderr,"latency ms   mean %.2f  p50 %.2f  p90 %.2f  p99 %.2f\n",meanLatency*1e3,
+            percentile(latency,.5)*1e3,percentile(latency,.9)*1e3,percentile(latency,.99)*1e3);
+    fprintf(stderr,"ATE          %.4g (scene units, plane at about %.4g)\n",ate,1/(synthPlane()[2]*sceneScale));
+    fprintf(stderr,"RPE          %.4g per frame, %.4g deg per frame\n",rpeT,rpeR);
+    for(size_t i=0;i<mapIds.size();i++)
+        fprintf(stderr,"depth map %3d  RMSE %.4g inverse depth, %.2f%% of the mean\n",mapIds[i],mapRmse[i],mapRel[i]*100);
+    fprintf(stderr,"%-32s %8s %10s %10s %10s\n","stage","count","mean ms","p50 ms","p99 ms");
+    for(size_t i=0;i<zones.size();i++){
+        const Profiler::ZoneStats& z=zones[i];
+        fprintf(stderr,"%-32s %8llu %10.3f %10.3f %10.3f\n",z.path.c_str(),(unsigned long long)z.count,
+                z.count ? z.total/z.count*1e3 : 0.0,z.p50*1e3,z.p99*1e3);
+    }
+
+    printf("{\"benchmark\":\"endToEnd\",\"rows\":%d,\"cols\":%d,\"layers\":%d,\"frames\":%d,\"seeds\":%d,\n",
+           rows,cols,layers,frames,seeds);
+    printf(" \"first_map_seconds\":%.6g,\"tracked\":%d,\"lost\":%d,\"fps\":%.6g,\n",mapSeconds,tracked,lost,fps);
+    printf(" \"latency_seconds\":{\"mean\":%.6g,\"p50\":%.6g,\"p90\":%.6g,\"p99\":%.6g},\n",meanLatency,
+           percentile(latency,.5),percentile(latency,.9),percentile(latency,.99));
+    printf(" \"ate_rmse\":%.6g,\"rpe_translation_rmse\":%.6g,\"rpe_rotation_deg\":%.6g,\n",ate,rpeT,rpeR);
+    printf(" \"depth\":[");
+    for(size_t i=0;i<mapIds.size();i++)
+        printf("%s{\"frame\":%d,\"rmse\":%.6g,\"relative\":%.6g}",i ? "," : "",mapIds[i],mapRmse[i],mapRel[i]);
+    printf("],\n \"stages\":[");
+    for(size_t i=0;i<zones.size();i++){
+        const Profiler::ZoneStats& z=zones[i];
+        printf("%s\n  {\"zone\":\"%s\",\"count\":%llu,\"total\":%.6g,\"min\":%.6g,\"p50\":%.6g,\"p90\":%.6g,\"p99\":%.6g,\"max\":%.6g}",
+               i ? "," : "",z.path.c_str(),(unsigned long long)z.count,z.total,z.min,z.p50,z.p90,z.p99,z.max);
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,214 @@
+// Free for non-commercial, non-military, and non-critical
+// use unless incorporated in OpenCV.
+// Inherits OpenCV Licence if in OpenCV.
+
+// Times the CPU kernels on the synthetic scene at several resolutions and
+// layer counts. Each kernel is warmed up once, then repeated until it has
+// run for a while; the median call is reported, as seconds and as
+// throughput (voxels/s for the kernels that touch every layer, pixels/s
+// for the rest). A TRACE_SCOPE while not recording is timed too, that is
+// what every instrumented call pays in a normal run.
+//
+// The table goes to stderr, a JSON document to stdout:
+//   benchKernels > kernels.json
+//
+// usage: benchKernels [--quick] [--seconds s]
+//   --quick    one small resolution, short runs
+//   --seconds  time spent on each kernel and size (default .5)
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CostVolume/Cost.h"
+#include "CostVolume/utils/reproject.hpp"
+#include "CostVolume/utils/reprojectCloud.hpp"
+#include "Track/Track.hpp"
+#include "utils/utils.hpp"
+#include "utils/Profiler.hpp"
+#include "utils/Trace.hpp"
+#include "synthScene.hpp"
+
+using namespace cv;
+using namespace std;
+
+void createPyramid(const Mat& image,vector<Mat>& pyramid,int& levels);//Track/align.part.cpp
+
+//The stages the library keeps private
+struct CostBench{
+    static void minv(Cost& cost,Mat& minIndex,Mat& minValue){
+        cost.minv(cost.data,minIndex,minValue);
+    }
+    static void cacheGValues(Cost& cost){
+        cost.cacheGValues();
+    }
+};
+struct TrackBench{
+    static bool alignLevel(Track& track,const Mat& base,const Mat& depth,const Mat& input,const Mat& cameraMatrix,const Mat& p){
+        return track.align_level_largedef_gray_forward(base,depth,input,cameraMatrix,p,CV_DTAM_FWD,.05,6);
+    }
+};
+
+struct BenchResult{
+    string kernel;
+    int rows,cols,layers;//layers 0 where they don't apply
+    int reps;
+    double seconds;//median per call
+    double minSeconds;
+    double throughput;
+    const char* unit;
+};
+
+static double minTime=.5;
+static vector<BenchResult> results;
+
+static void timeKernel(const char* kernel,int rows,int cols,int layers,double units,const char* unit,const function<void()>& body){
+    body();//warm up: page faults, lazy allocations
+    vector<double> t;
+    Profiler::Stopwatch total;
+    while(t.size()<3 || (total.seconds()<minTime && t.size()<200)){
+        Profiler::Stopwatch one;
+        body();
+        t.push_back(one.seconds());
+    }
+    sort(t.begin(),t.end());
+    BenchResult r;
+    r.kernel=kernel;
+    r.rows=rows;
+    r.cols=cols;
+    r.layers=layers;
+    r.reps=t.size();
+    r.seconds=t[t.size()/2];
+    r.minSeconds=t[0];
+    r.throughput=units/r.seconds;
+    r.unit=unit;
+    results.push_back(r);
+    fprintf(stderr,"%-42s %4dx%-4d %3d  %6d  %10.4f  %10.4f  %10.3e %s\n",kernel,cols,rows,layers,r.reps,
+            r.seconds*1e3,r.minSeconds*1e3,r.throughput,unit);
+}
+
+static void benchCost(int rows,int cols,int layers,const Mat& base3,const Mat& view3,const Mat& cameraMatrix,const Matx44d& viewPose){
+    double voxels=(double)rows*cols*layers;
+    double pixels=(double)rows*cols;
+    Mat I=Mat::eye(3,3,CV_64FC1),Z=Mat::zeros(3,1,CV_64FC1);
+    Cost cost(base3,layers,cameraMatrix,I,Z);
+
+    timeKernel("Cost::updateCostL1",rows,cols,layers,voxels,"voxels/s",[&](){
+        cost.updateCostL1(view3,viewPose);
+    });
+    timeKernel("Cost::updateCostL2",rows,cols,layers,voxels,"voxels/s",[&](){
+        cost.updateCostL2(view3,viewPose);
+    });
+    Mat ind(rows,cols,CV_32SC1),val(rows,cols,CV_32FC1);
+    timeKernel("Cost::minv",rows,cols,layers,voxels,"voxels/s",[&](){
+        CostBench::minv(cost,ind,val);
+    });
+    timeKernel("Cost::cacheGValues",rows,cols,layers,pixels,"pixels/s",[&](){
+        CostBench::cacheGValues(cost);
+    });
+    cost.initOptimization();
+    timeKernel("Cost::optimizeQD",rows,cols,layers,pixels,"pixels/s",[&](){
+        cost.optimizeQD();
+    });
+    timeKernel("Cost::optimizeA",rows,cols,layers,voxels,"voxels/s",[&](){
+        cost.optimizeA();
+    });
+}
+
+static void benchImage(int rows,int cols,int layers){
+    Mat cameraMatrix=synthCameraMatrix(rows,cols);
+    Mat tex=synthTexture(rows,cols);
+    Mat depth=synthDepth(rows,cols,cameraMatrix);
+    Mat p=synthTrajectory(5);
+    Mat view=synthView(tex,cameraMatrix,p);
+    Mat base3,view3;
+    cvtColor(tex,base3,cv::COLOR_GRAY2BGR);
+    cvtColor(view,view3,cv::COLOR_GRAY2BGR);
+    Matx44d basePose=Matx44d::eye();
+    Matx44d viewPose(LieToP(p));
+    double pixels=(double)rows*cols;
+
+    if(layers>0){
+        benchCost(rows,cols,layers,base3,view3,cameraMatrix,viewPose);
+        return;
+    }
+
+    Mat_<Vec3f> plane;
+    Mat_<uchar> mask;
+    timeKernel("reproject",rows,cols,0,pixels,"pixels/s",[&](){
+        reproject(Mat_<Vec3f>(view3),Matx33d(cameraMatrix),basePose,viewPose,depth.at<float>(rows/2,cols/2),plane,mask);
+    });
+    timeKernel("reprojectCloud",rows,cols,0,pixels,"pixels/s",[&](){
+        reprojectCloud(view3,base3,depth,Mat(basePose),Mat(viewPose),cameraMatrix);
+    });
+    vector<Mat> pyr;
+    timeKernel("createPyramid",rows,cols,0,pixels,"pixels/s",[&](){
+        int levels=0;
+        createPyramid(view,pyr,levels);
+    });
+    Track track(tex,depth,cameraMatrix,Mat::eye(3,3,CV_64FC1),Mat::zeros(3,1,CV_64FC1));
+    Mat K=make4x4(cameraMatrix);
+    Mat start=Mat::zeros(1,6,CV_64FC1);
+    timeKernel("Track::align_level_largedef_gray_forward",rows,cols,0,pixels,"pixels/s",[&](){
+        Mat q=start.clone();//one iteration from the same place each time
+        TrackBench::alignLevel(track,tex,depth,view,K,q);
+    });
+}
+
+static void benchTraceScope(){
+    const int n=1000000;
+    bool was=Trace::enabled();//DTAM_TRACE records from startup
+    Trace::stop();
+    timeKernel("TRACE_SCOPE (not recording)",0,0,0,n,"scopes/s",[&](){
+        for(int i=0;i<n;i++){
+            TRACE_SCOPE("bench");
+        }
+    });
+    fprintf(stderr,"%-42s %.3f ns per scope\n","",1e9/results.back().throughput);
+    if(was)
+        Trace::start();
+}
+
+int main(int argc,char** argv){
+    bool quick=false;
+    for(int i=1;i<argc;i++){
+        if(!strcmp(argv[i],"--quick")){
+            quick=true;
+            minTime=.05;
+        }else if(!strcmp(argv[i],"--seconds") && i+1<argc){
+            minTime=atof(argv[++i]);
+        }else{
+            fprintf(stderr,"usage: %s [--quick] [--seconds s]\n",argv[0]);
+            return 1;
+        }
+    }
+    int sizes[][2]={{120,160},{240,320},{480,640}};
+    int layerCounts[]={16,32,64};
+    int nSizes=quick ? 1 : 3;
+    int nLayers=quick ? 1 : 3;
+
+    fprintf(stderr,"%-42s %9s %3s  %6s  %10s  %10s  %s\n","kernel","size","lyr","reps","median ms","min ms","throughput");
+    benchTraceScope();
+    for(int s=0;s<nSizes;s++){
+        int rows=sizes[s][0],cols=sizes[s][1];
+        benchImage(rows,cols,0);
+        for(int l=0;l<nLayers;l++)
+            benchImage(rows,cols,layerCounts[l]);
+    }
+
+    printf("{\"benchmark\":\"kernels\",\"results\":[");
+    for(size_t i=0;i<results.size();i++){
+        const BenchResult& r=results[i];
+        printf("%s\n  {\"kernel\":\"%s\",\"rows\":%d,\"cols\":%d,\"layers\":%d,\"reps\":%d,"
+               "\"seconds\":%.9g,\"min_seconds\":%.9g,\"throughput\":%.6g,\"unit\":\"%s\"}",
+               i ? "," : "",r.kernel.c_str(),r.rows,r.cols,r.layers,r.reps,r.seconds,r.minSeconds,r.throughput,r.unit);
+    }
+    printf("\n]}\n");
+    return 0;
+}
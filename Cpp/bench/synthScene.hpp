@@ -0,0 +1,85 @@
+// Free for non-commercial, non-military, and non-critical
+// use unless incorporated in OpenCV.
+// Inherits OpenCV Licence if in OpenCV.
+
+#ifndef SYNTH_SCENE_HPP
+#define SYNTH_SCENE_HPP
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "utils/utils.hpp"
+
+// A synthetic scene for the benchmarks: a textured plane seen from a
+// known camera, so depth and poses are exact and no dataset is needed.
+//
+// The plane is n'*X=1 in the base camera frame, which makes the inverse
+// depth of a base pixel x:
+//   d(x) = n'*K^-1*x
+// and the view from a camera at relative pose [R|T] a homography:
+//   H = K*(R+T*n')*K^-1
+// This is the same parameterization the tracker uses (inverse depth in
+// the third slot), so the rendered views are exactly trackable.
+
+static cv::Mat synthCameraMatrix(int rows,int cols){
+    double f=cols*.75;
+    return (cv::Mat)(cv::Mat_<double>(3,3) <<  f,0.0,(cols-1)/2.0,
+                                                0.0,f,(rows-1)/2.0,
+                                                0.0,0.0,1.0);
+}
+
+//Band limited noise in [.1,.9], textured at several scales so every pyramid level has gradients
+static cv::Mat synthTexture(int rows,int cols,int seed=1){
+    cv::RNG rng(seed);
+    cv::Mat tex(rows,cols,CV_32FC1,cv::Scalar(0));
+    for (double sigma=1.0; sigma<cols/8.0; sigma*=2){
+        cv::Mat noise(rows,cols,CV_32FC1);
+        rng.fill(noise,cv::RNG::UNIFORM,0.0,1.0);
+        cv::GaussianBlur(noise,noise,cv::Size(),sigma);
+        double mn,mx;
+        cv::minMaxLoc(noise,&mn,&mx);
+        tex+=(noise-mn)/(mx-mn);
+    }
+    double mn,mx;
+    cv::minMaxLoc(tex,&mn,&mx);
+    tex=(tex-mn)*(.8/(mx-mn))+.1;
+    return tex;
+}
+
+//the default plane: slanted, about 2 units in front of the camera
+static cv::Vec3d synthPlane(){
+    return cv::Vec3d(.1,.05,.5);
+}
+
+static cv::Mat synthDepth(int rows,int cols,const cv::Mat& cameraMatrix,cv::Vec3d n=synthPlane()){
+    cv::Matx33d Kinv=cv::Matx33d(cameraMatrix).inv();
+    cv::Mat depth(rows,cols,CV_32FC1);
+    for(int i=0;i<rows;i++){
+        float* d=depth.ptr<float>(i);
+        for(int j=0;j<cols;j++){
+            d[j]=(float)n.dot(Kinv*cv::Vec3d(j,i,1));
+        }
+    }
+    return depth;
+}
+
+//Render the plane texture from relative pose p (Lie parameters, base camera -> new camera)
+static cv::Mat synthView(const cv::Mat& texture,const cv::Mat& cameraMatrix,const cv::Mat& p,cv::Vec3d n=synthPlane()){
+    cv::Mat R,T;
+    LieToRT(p,R,T);
+    cv::Mat H=cameraMatrix*(R+T*cv::Mat(n).t())*cameraMatrix.inv();
+    cv::Mat view;
+    cv::warpPerspective(texture,view,H,texture.size(),cv::INTER_LINEAR,cv::BORDER_CONSTANT,0.0);
+    return view;
+}
+
+//A smooth hand held looking trajectory, frame k relative to the base camera
+static cv::Mat synthTrajectory(int k){
+    double t=k;
+    return (cv::Mat)(cv::Mat_<double>(1,6) <<   .002*t*sin(t*.2),
+                                                .003*t,
+                                                .001*t*cos(t*.3),
+                                                .01*t,
+                                                .004*t*sin(t*.1),
+                                                .008*t);
+}
+
+#endif
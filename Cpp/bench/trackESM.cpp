@@ -0,0 +1,82 @@
+// Free for non-commercial, non-military, and non-critical
+// use unless incorporated in OpenCV.
+// Inherits OpenCV Licence if in OpenCV.
+
+// Compares the forward additive and ESM trackers on a synthetic trajectory.
+// Each frame starts from the tracker's motion model, the previous two
+// estimates' velocity repeated (velocityDecay=1), and iterates every
+// level until the step drops below tolerance or stops lowering the
+// residual, so the iteration count is a direct measure of convergence
+// speed.
+//
+// usage: benchTrackESM [frames] [rows] [cols]
+
+#include <opencv2/core/core.hpp>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Track/Track.hpp"
+#include "utils/utils.hpp"
+#include "synthScene.hpp"
+
+using namespace cv;
+using namespace std;
+
+struct TrackRun{
+    double iters;//mean iterations per frame
+    double seconds;//mean time per frame
+    double rotErr;//mean final error
+    double transErr;
+    int unconverged;
+};
+
+static TrackRun runTrajectory(int mode,int frames,const Mat& tex,const Mat& depth,const Mat& cameraMatrix){
+    Track tracker(tex,depth,cameraMatrix,Mat::eye(3,3,CV_64FC1),Mat::zeros(3,1,CV_64FC1));
+    tracker.levels2D=0;//the motion model's prediction is close, no pre-alignment wanted
+    tracker.levelModes.assign(6,mode);
+    tracker.maxIters=30;
+    tracker.stepTol=1e-5;
+
+    TrackRun run={0,0,0,0,0};
+    for(int k=1;k<=frames;k++){
+        Mat truth=synthTrajectory(k);
+        tracker.addFrame(synthView(tex,cameraMatrix,truth));
+        AlignReport report=tracker.align(HUGE_VAL);
+        run.seconds+=report.seconds;
+        run.iters+=report.iters;
+        run.unconverged+=(report.iter==tracker.maxIters);
+        Mat err=LieSub(tracker.pose,truth);
+        run.rotErr+=norm(err.colRange(0,3));
+        run.transErr+=norm(err.colRange(3,6));
+    }
+    run.iters/=frames;
+    run.seconds/=frames;
+    run.rotErr/=frames;
+    run.transErr/=frames;
+    return run;
+}
+
+int main(int argc,char** argv){
+    int frames=argc>1?atoi(argv[1]):20;
+    int rows  =argc>2?atoi(argv[2]):480;
+    int cols  =argc>3?atoi(argv[3]):640;
+
+    Mat cameraMatrix=synthCameraMatrix(rows,cols);
+    Mat tex=synthTexture(rows,cols);
+    Mat depth=synthDepth(rows,cols,cameraMatrix);
+
+    const char* names[]={"FWD","ESM"};
+    int modes[]={CV_DTAM_FWD,CV_DTAM_ESM};
+    TrackRun runs[2];
+    for(int m=0;m<2;m++){
+        runs[m]=runTrajectory(modes[m],frames,tex,depth,cameraMatrix);
+    }
+    printf("\n%d frames at %dx%d\n",frames,cols,rows);
+    printf("mode   iters/frame  ms/frame  rot err     trans err   unconverged\n");
+    for(int m=0;m<2;m++){
+        printf("%-4s  %12.2f  %8.2f  %.3e   %.3e   %d\n",names[m],runs[m].iters,runs[m].seconds*1000,
+               runs[m].rotErr,runs[m].transErr,runs[m].unconverged);
+    }
+    return 0;
+}
@@ -3,129 +3,246 @@
 // It is based on a file they provided there, but makes the world coordinate system right handed, with z up,
 // x right, and y forward.
 
+#include "convertAhandaPovRayToStandard.h"
 #include <opencv2/core.hpp>
 #include <iostream>
-#include <fstream>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace cv;
 using namespace std;
-Vec3f direction;
-Vec3f upvector;
-void convertAhandaPovRayToStandard(const char * filepath,
-                                   int imageNumber,
-                                   Mat& cameraMatrix,
-                                   Mat& R,
-                                   Mat& T)
-{
-    char text_file_name[600];
-    sprintf(text_file_name,"%s/scene_%03d.txt",filepath,imageNumber);
 
-    cout << "text_file_name = " << text_file_name << endl;
+#define AHANDA_SCENE_MAX 8192 //bytes, the files are a few hundred
+#define AHANDA_CACHE_VERSION 1
+
+static const double ahandaK[9]={481.20,0.0,319.5,
+                                0.0,480.0,239.5,
+                                0.0,0.0,1.0};
+
+//The whole file into buf, NUL terminated. No allocation.
+static bool readScene(const char* path,char* buf,size_t cap){
+    int fd=open(path,O_RDONLY);
+    if(fd<0)
+        return false;
+    size_t len=0;
+    ssize_t r;
+    while(len<cap-1 && (r=read(fd,buf+len,cap-1-len))>0)
+        len+=r;
+    close(fd);
+    buf[len]=0;
+    return true;
+}
 
-    ifstream cam_pars_file(text_file_name);
-    if(!cam_pars_file.is_open())
-    {
-        cerr<<"Failed to open param file, check location of sample trajectory!"<<endl;
-        exit(1);
+//"key = [a, b, c]" somewhere in text
+static bool parseVec(const char* text,const char* key,double v[3]){
+    const char* p=strstr(text,key);
+    if(!p)
+        return false;
+    while(*p && *p!='[' && *p!='\n')
+        p++;
+    if(*p!='[')
+        return false;
+    p++;
+    for(int i=0;i<3;i++){
+        char* e;
+        v[i]=strtod(p,&e);
+        if(e==p)
+            return false;
+        p=e;
+        while(*p==' '||*p==',')
+            p++;
     }
+    return true;
+}
 
-    char readlinedata[300];
-
-    Point3d direction;
-    Point3d upvector;
-    Point3d posvector;
-
-
-    while(1){
-        cam_pars_file.getline(readlinedata,300);
-//         cout<<readlinedata<<endl;
-        if ( cam_pars_file.eof())
-            break;
-
-
-        istringstream iss;
-
-
-        if ( strstr(readlinedata,"cam_dir")!= NULL){
-
-
-            string cam_dir_str(readlinedata);
-
-            cam_dir_str = cam_dir_str.substr(cam_dir_str.find("= [")+3);
-            cam_dir_str = cam_dir_str.substr(0,cam_dir_str.find("]"));
-
-            iss.str(cam_dir_str);
-            iss >> direction.x ;
-            iss.ignore(1,',');
-            iss >> direction.z ;
-            iss.ignore(1,',') ;
-            iss >> direction.y;
-            iss.ignore(1,',');
-//             cout << "direction: "<< direction.x<< ", "<< direction.y << ", "<< direction.z << endl;
-
-        }
+static bool parseScene(const char* text,AhandaTrajectory::Record& rec){
+    double dir[3],up[3],pos[3];
+    if(!parseVec(text,"cam_dir",dir) || !parseVec(text,"cam_up",up) || !parseVec(text,"cam_pos",pos))
+        return false;
+    //the files are x,z,y
+    Vec3d direction(dir[0],dir[2],dir[1]);
+    Vec3d upvector(up[0],up[2],up[1]);
+    Vec3d posvector(pos[0],pos[2],pos[1]);
+
+    Vec3d right=direction.cross(upvector);
+    Matx33d R(right[0],    right[1],    right[2],
+              -upvector[0],-upvector[1],-upvector[2],
+              direction[0],direction[1],direction[2]);
+    Vec3d T=-(R*posvector);
+    for(int i=0;i<9;i++)
+        rec.R[i]=R.val[i];
+    for(int i=0;i<3;i++)
+        rec.T[i]=T[i];
+    return true;
+}
 
-        if ( strstr(readlinedata,"cam_up")!= NULL){
+static void scenePath(char* out,size_t cap,const char* dir,int imageNumber){
+    snprintf(out,cap,"%s/scene_%03d.txt",dir,imageNumber);
+}
 
-            string cam_up_str(readlinedata);
+bool convertAhandaPovRayToStandard(const char * filepath,
+                                   int imageNumber,
+                                   Mat& cameraMatrix,
+                                   Mat& R,
+                                   Mat& T)
+{
+    char text_file_name[600];
+    scenePath(text_file_name,sizeof(text_file_name),filepath,imageNumber);
 
-            cam_up_str = cam_up_str.substr(cam_up_str.find("= [")+3);
-            cam_up_str = cam_up_str.substr(0,cam_up_str.find("]"));
+    char text[AHANDA_SCENE_MAX];
+    AhandaTrajectory::Record rec;
+    if(!readScene(text_file_name,text,sizeof(text)) || !parseScene(text,rec))
+        return false;
 
+    Mat(3,3,CV_64F,rec.R).copyTo(R);
+    Mat(3,1,CV_64F,rec.T).copyTo(T);
+   /* cameraMatrix=(Mat_<double>(3,3) << 480,0.0,320.5,
+										    0.0,480.0,240.5,
+										    0.0,0.0,1.0);*/
+    Mat(3,3,CV_64F,(void*)ahandaK).copyTo(cameraMatrix);
+    return true;
+}
 
-            iss.str(cam_up_str);
-            iss >> upvector.x ;
-            iss.ignore(1,',');
-            iss >> upvector.z ;
-            iss.ignore(1,',');
-            iss >> upvector.y ;
-            iss.ignore(1,',');
+//sidecar layout: this header, then Record[count]
+struct AhandaCacheHeader{
+    char magic[8];       //"ODMTRAJ"
+    uint32_t version;
+    uint32_t recordBytes;//sizeof(Record), catches a foreign layout
+    int32_t first;
+    int32_t count;
+    double K[9];
+};
+
+AhandaTrajectory::AhandaTrajectory():poses(NULL),mapped(NULL),mappedBytes(0),n(0),firstIndex(0){
+    memcpy(K,ahandaK,sizeof(K));
+}
 
+AhandaTrajectory::~AhandaTrajectory(){
+    unmap();
+}
 
+void AhandaTrajectory::unmap(){
+    if(mapped)
+        munmap(mapped,mappedBytes);
+    mapped=NULL;
+    mappedBytes=0;
+}
 
+AhandaTrajectory::Status AhandaTrajectory::load(const string& dir,int first,int count,bool useCache){
+    unmap();
+    parsed.clear();
+    poses=NULL;
+    n=0;
+    firstIndex=first;
+    message.clear();
+    memcpy(K,ahandaK,sizeof(K));
+
+    string cache=dir+"/scene_poses.odmtraj";
+    if(useCache && mapCache(cache,first,count,dir))
+        return OK;
+
+    char path[600];
+    char text[AHANDA_SCENE_MAX];//reused for every file
+    if(count>0)
+        parsed.reserve(count);
+    for(int i=0;count<0 || i<count;i++){
+        scenePath(path,sizeof(path),dir.c_str(),first+i);
+        if(!readScene(path,text,sizeof(text))){
+            if(count<0 && i>0)
+                break;//end of the sequence
+            message=path;
+            parsed.clear();
+            return i==0 ? EMPTY : MISSING_FILE;
         }
-
-        if ( strstr(readlinedata,"cam_pos")!= NULL){
-//            cout<< "cam_pos is present!"<<endl;
-
-            string cam_pos_str(readlinedata);
-
-            cam_pos_str = cam_pos_str.substr(cam_pos_str.find("= [")+3);
-            cam_pos_str = cam_pos_str.substr(0,cam_pos_str.find("]"));
-
-//            cout << "cam pose str = " << endl;
-//            cout << cam_pos_str << endl;
-
-            iss.str(cam_pos_str);
-            iss >> posvector.x ;
-            iss.ignore(1,',');
-            iss >> posvector.z ;
-            iss.ignore(1,',');
-            iss >> posvector.y ;
-            iss.ignore(1,',');
-//             cout << "position: "<<posvector.x<< ", "<< posvector.y << ", "<< posvector.z << endl;
-
+        Record rec;
+        if(!parseScene(text,rec)){
+            message=path;
+            parsed.clear();
+            return PARSE_ERROR;
         }
-
+        parsed.push_back(rec);
     }
+    n=parsed.size();
+    poses=n ? &parsed[0] : NULL;
+    if(useCache && !writeCache(cache))
+        cerr<<"AhandaTrajectory: could not write "<<cache<<", poses will be parsed again next time"<<endl;
+    return OK;
+}
 
-    R=Mat(3,3,CV_64F);
-    R.row(0)=Mat(direction.cross(upvector)).t();
-    R.row(1)=Mat(-upvector).t();
-    R.row(2)=Mat(direction).t();
-
-    T=-R*Mat(posvector);
-//     cout<<"T: "<<T<<endl<<"pos: "<<Mat(posvector)<<endl;
-   /* cameraMatrix=(Mat_<double>(3,3) << 480,0.0,320.5,
-										    0.0,480.0,240.5,
-										    0.0,0.0,1.0);*/
-    cameraMatrix=(Mat_<double>(3,3) << 481.20,0.0,319.5,
-                  0.0,480.0,239.5,
-                  0.0,0.0,1.0);
-
+//Usable if it starts at first, covers count (or, count<0, the whole current
+// sequence) and no text file in that range changed after it was written.
+bool AhandaTrajectory::mapCache(const string& path,int first,int count,const string& dir){
+    int fd=open(path.c_str(),O_RDONLY);
+    if(fd<0)
+        return false;
+    struct stat st;
+    AhandaCacheHeader h;
+    bool ok=fstat(fd,&st)==0 && read(fd,&h,sizeof(h))==(ssize_t)sizeof(h) &&
+            memcmp(h.magic,"ODMTRAJ",8)==0 && h.version==AHANDA_CACHE_VERSION &&
+            h.recordBytes==sizeof(Record) && h.first==first && h.count>0 &&
+            (size_t)st.st_size==sizeof(h)+h.count*sizeof(Record) &&
+            (count<0 || h.count>=count);
+    int use=count<0 ? h.count : count;
+    char scene[600];
+    for(int i=0;ok && i<use;i++){
+        struct stat ss;
+        scenePath(scene,sizeof(scene),dir.c_str(),first+i);
+        ok=stat(scene,&ss)==0 && ss.st_mtime<=st.st_mtime;
+    }
+    if(ok && count<0){//the sequence must not have grown since
+        struct stat ss;
+        scenePath(scene,sizeof(scene),dir.c_str(),first+use);
+        ok=stat(scene,&ss)!=0;
+    }
+    void* m=ok ? mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0) : MAP_FAILED;
+    close(fd);
+    if(m==MAP_FAILED)
+        return false;
+    mapped=m;
+    mappedBytes=st.st_size;
+    poses=(const Record*)((const char*)m+sizeof(AhandaCacheHeader));
+    n=use;
+    memcpy(K,h.K,sizeof(K));
+    return true;
 }
 
+bool AhandaTrajectory::writeCache(const string& path) const{
+    AhandaCacheHeader h;
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,"ODMTRAJ",8);
+    h.version=AHANDA_CACHE_VERSION;
+    h.recordBytes=sizeof(Record);
+    h.first=firstIndex;
+    h.count=n;
+    memcpy(h.K,K,sizeof(K));
+
+    string tmp=path+".tmp";//renamed into place, a reader never sees half a file
+    FILE* f=fopen(tmp.c_str(),"wb");
+    if(!f)
+        return false;
+    bool ok=fwrite(&h,sizeof(h),1,f)==1 && (n==0 || fwrite(poses,sizeof(Record),n,f)==(size_t)n);
+    ok&=fclose(f)==0;
+    if(ok)
+        ok=rename(tmp.c_str(),path.c_str())==0;
+    if(!ok)
+        remove(tmp.c_str());
+    return ok;
+}
 
+bool AhandaTrajectory::pose(int i,Mat& R,Mat& T) const{
+    if(i<0 || i>=n)
+        return false;
+    Mat(3,3,CV_64F,(void*)poses[i].R).copyTo(R);
+    Mat(3,1,CV_64F,(void*)poses[i].T).copyTo(T);
+    return true;
+}
 
+Mat AhandaTrajectory::cameraMatrix() const{
+    return Mat(3,3,CV_64F,(void*)K).clone();
+}
@@ -2,10 +2,75 @@
 #define CONVERTAHANDAPOVRAYTOSTANDARD_H_INCLUDED
 
 #include <opencv2/core.hpp>
-void convertAhandaPovRayToStandard(const char * filepath,
+#include <string>
+#include <vector>
+
+//false (with R,T untouched) if scene_%03d.txt is missing or has no camera
+bool convertAhandaPovRayToStandard(const char * filepath,
                                    int imageNumber,
                                    cv::Mat& cameraMatrix,
                                    cv::Mat& R,
                                    cv::Mat& T);
 
+//A whole trajectory of scene_%03d.txt files, parsed once.
+//
+// The parsed poses are written next to the text files as a binary sidecar
+// (scene_poses.odmtraj). Later loads memory map that instead of parsing,
+// as long as it covers the frames asked for and no text file is newer.
+// A sidecar that cannot be written (read only dataset) only costs the
+// speedup, load() still succeeds.
+class AhandaTrajectory{
+public:
+    enum Status{
+        OK=0,
+        MISSING_FILE,//a frame inside the requested range has no text file
+        PARSE_ERROR, //a text file without cam_pos, cam_dir or cam_up
+        EMPTY        //not even the first frame exists
+    };
+
+    AhandaTrajectory();
+    ~AhandaTrajectory();
+
+    //count<0 loads until the first missing file
+    Status load(const std::string& dir,int first=0,int count=-1,bool useCache=true);
+    const std::string& error() const{//which file, after a failed load
+        return message;
+    }
+
+    int size() const{
+        return n;
+    }
+    int first() const{
+        return firstIndex;
+    }
+    bool cached() const{//poses came from the sidecar
+        return mapped!=NULL;
+    }
+    //i counts from first(), R,T as convertAhandaPovRayToStandard gives them
+    bool pose(int i,cv::Mat& R,cv::Mat& T) const;
+    cv::Mat cameraMatrix() const;
+
+    struct Record{
+        double R[9];
+        double T[3];
+    };
+
+private:
+    void unmap();
+    bool mapCache(const std::string& path,int first,int count,const std::string& dir);
+    bool writeCache(const std::string& path) const;
+
+    std::vector<Record> parsed;
+    const Record* poses;//into parsed or the mapping
+    void* mapped;
+    size_t mappedBytes;
+    int n;
+    int firstIndex;
+    double K[9];
+    std::string message;
+
+    AhandaTrajectory(const AhandaTrajectory&);
+    AhandaTrajectory& operator = (const AhandaTrajectory&);
+};
+
 #endif // CONVERTAHANDAPOVRAYTOSTANDARD_H_INCLUDED
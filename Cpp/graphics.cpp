@@ -1,33 +1,139 @@
+#include "graphics.hpp"
+StopToken allDie;//the gui is gone, stop waiting on it
+
+#ifndef DTAM_NO_GUI
 #include <opencv2/highgui/highgui.hpp>
-#include <boost/thread/mutex.hpp>
-#include <queue>
+#include <map>
+#include <vector>
+#include <utility>
 #include <string>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sys/stat.h>
 #include "set_affinity.h"
+#include "Scheduler/ImplMutex.hpp"
+#include "Scheduler/Placement.hpp"
 #include "utils/ImplThreadLaunch.hpp"
-#include "graphics.hpp"
+#include "utils/Profiler.hpp"
 
 using namespace std;
 using namespace cv;
-static queue<Mat> toShow;
-static queue<string> nameShow;
-static queue<Vec2d> autoScale;
-
-static queue<int> props;
-static queue<string> nameWin;
-static boost::mutex Gmux; 
-static volatile int ready=0;
-static volatile int pausing=0;
-int allDie=0;
-void gpause(){
-    CV_XADD(&pausing,1);
-    gcheck();
+
+//One per window name. At most one frame waits in it, the newest.
+struct ShowWindow{
+    Mat mat;
+    Vec2d autoscale;
+    bool fresh;       //mat not drawn yet
+    double last;      //seconds, when the last frame was taken
+    double interval;  //<0: the default
+    int prop;         //for namedWindow
+    bool propFresh;
+    int written;      //files mode frame number
+    ShowWindow():fresh(false),last(-1e30),interval(-1),prop(0),propFresh(false),written(0){}
+};
+
+static ImplMutex Gmux;
+static ImplCondVar Gcond;//a frame arrived, a pause ended, or the gui stopped
+static map<string,ShowWindow> windows;
+static int pausing=0;
+static bool consumer=false;//a guiLoop is running
+static ShowMode mode=SHOW_WINDOWS;
+static string fileDir=".";
+static double defaultInterval=0.1;
+
+static double now(){
+    return getTickCount()/getTickFrequency();
 }
-void gcheck(){
-    while(ready||CV_XADD(&pausing,0)){
-        usleep(100);
-        if(allDie)
-                    return;
+
+//DTAM_SHOW and DTAM_SHOW_HZ, read on first use
+static void readEnv(){
+    static bool done=false;
+    if(done)
+        return;
+    done=true;
+    const char* hz=getenv("DTAM_SHOW_HZ");
+    if(hz){
+        double r=atof(hz);
+        defaultInterval=r>0 ? 1.0/r : 0;
     }
+    const char* m=getenv("DTAM_SHOW");
+    if(!m)
+        return;
+    string s(m);
+    if(s=="off" || s=="0" || s=="none"){
+        mode=SHOW_OFF;
+    }else if(s.compare(0,5,"files")==0){
+        mode=SHOW_FILES;
+        fileDir=s.size()>6 && s[5]==':' ? s.substr(6) : ".";
+        mkdir(fileDir.c_str(),0755);
+    }else if(s.compare(0,6,"window")==0){
+        mode=SHOW_WINDOWS;
+    }else{
+        cerr<<"DTAM_SHOW="<<s<<" not understood, use off, windows or files:DIR"<<endl;
+    }
+}
+
+static bool accepting(){
+    return mode!=SHOW_OFF && consumer && !allDie.stopRequested();
+}
+
+static double intervalOf(const ShowWindow& w){
+    return w.interval>=0 ? w.interval : defaultInterval;
+}
+
+void pfShowMode(ShowMode m,const string& dir){
+    ScopeLock s(Gmux);
+    readEnv();
+    mode=m;
+    fileDir=dir;
+    if(m==SHOW_FILES)
+        mkdir(fileDir.c_str(),0755);
+    if(m!=SHOW_WINDOWS)//nobody left to press space
+        pausing=0;
+    Gcond.broadcast();
+}
+
+void pfShowRate(double hz,const string& name){
+    ScopeLock s(Gmux);
+    readEnv();
+    double interval=hz>0 ? 1.0/hz : 0;
+    if(name.empty())
+        defaultInterval=interval;
+    else
+        windows[name].interval=interval;
+}
+
+bool pfShowing(const string& name){
+    ScopeLock s(Gmux);
+    readEnv();
+    if(!accepting())
+        return false;
+    if(name.empty())
+        return true;
+    map<string,ShowWindow>::iterator it=windows.find(name);
+    return it==windows.end() || now()-it->second.last>=intervalOf(it->second);
+}
+
+void gpause(StopToken* stop){
+    StopLink link;//attached outside Gmux, its waker takes Gmux under the token's lock
+    link.set(stop,[](){
+        ScopeLock s(Gmux);
+        Gcond.broadcast();
+    });
+    ScopeLock s(Gmux);
+    readEnv();
+    if(mode!=SHOW_WINDOWS || !accepting() || link.stopped())
+        return;
+    pausing++;
+    while(pausing && !allDie.stopRequested() && !link.stopped())
+        Gcond.wait(Gmux);
+}
+void gcheck(){
+    ScopeLock s(Gmux);
+    while(pausing && !allDie.stopRequested())
+        Gcond.wait(Gmux);
 }
 
 void pfShow(const string name,const Mat& _mat,int defaultscale, Vec2d autoscale){
@@ -36,104 +142,165 @@ void pfShow(const string name,const Mat& _mat,int defaultscale, Vec2d autoscale)
     if (defaultscale==1){
         autoscale=Vec2d(-1,-1);
     }
-    //cull frames
-    Gmux.lock();
-    nameShow.push(name);
-    toShow.push(_mat.clone());
-    autoScale.push(autoscale);
-    ready++;
-    assert(nameShow.size()==ready);
-    
-    Gmux.unlock();
-    while(nameShow.size()>5||pausing){
-        usleep(100);
-        if(allDie)
-                    return;
+    //cull frames: take the slot before copying, so a dropped frame costs no clone
+    {
+        ScopeLock s(Gmux);
+        readEnv();
+        if(!accepting())
+            return;
+        ShowWindow& w=windows[name];
+        double t=now();
+        if(t-w.last<intervalOf(w))
+            return;
+        w.last=t;
     }
-
+    Mat copy=_mat.clone();
+    ScopeLock s(Gmux);
+    if(!consumer)
+        return;
+    ShowWindow& w=windows[name];
+    w.mat=copy;//replaces a frame the gui has not got to
+    w.autoscale=autoscale;
+    w.fresh=true;
+    Gcond.broadcast();
 }
 void pfWindow(const string name,int prop){
-    Gmux.lock();
-    nameWin.push(name);
-    props.push(prop);
-
-    Gmux.unlock();
-    while(nameWin.size()>5||pausing){
-        usleep(100);
-        if(allDie)
-                    return;
-    }
-}
-template <class T>
-static inline T take(queue<T>& q){
-    T ref=q.front();
-    q.pop();
-    return ref;
+    ScopeLock s(Gmux);
+    ShowWindow& w=windows[name];
+    w.prop=prop;
+    w.propFresh=true;
+    Gcond.broadcast();
 }
 
+//to 8 bit, so we can have the nice mouse over
+static void render(Mat& mat,Vec2d autoscale){
+    if ((autoscale[0]==autoscale[1] && autoscale[0]==0)){
+        double min;
+        double max;
+        cv::minMaxIdx(mat, &min, &max);
+        float scale = 1.0/ (max-min);
+        mat.convertTo(mat,CV_MAKETYPE(CV_32F,mat.channels()), scale, -min*scale);
+    }else if (autoscale[0]!=autoscale[1]){
+        double scale= 1.0/(autoscale[1]-autoscale[0]);
+        mat.convertTo(mat,CV_MAKETYPE(mat.type(),mat.channels()),scale,-autoscale[0]*scale);
+    }
+    mat.convertTo(mat,CV_MAKETYPE(CV_8U,mat.channels()), 255.0);
+}
 
+static string fileName(const string& name,int n){
+    string clean(name);
+    for(size_t i=0;i<clean.size();i++){
+        char c=clean[i];
+        if(!isalnum((unsigned char)c) && c!='-' && c!='_')
+            clean[i]='_';
+    }
+    char num[16];
+    snprintf(num,sizeof(num),"_%06d.png",n);
+    return fileDir+"/"+clean+num;
+}
 
+//Next window with a frame waiting, after the one drawn last so a busy
+// window cannot starve the others. Gmux held.
+static map<string,ShowWindow>::iterator nextFresh(const string& after){
+    map<string,ShowWindow>::iterator it=windows.upper_bound(after);
+    for(size_t i=0;i<windows.size();i++,it++){
+        if(it==windows.end())
+            it=windows.begin();
+        if(it->second.fresh)
+            return it;
+    }
+    return windows.end();
+}
 
-void guiLoop(int* die){
-    Mat mat;
-    while(!*die){
-        if (props.size()>0){//deal with new windows
-            Gmux.lock();
-            string name=take(nameWin);
-            int prop=take(props);
-            
-            Gmux.unlock();
-            namedWindow(name,prop);
+void guiLoop(StopToken& die){
+    Placement::global().apply("gui");
+    StopLink link;
+    link.set(&die,[](){ScopeLock s(Gmux); Gcond.broadcast();});
+    {
+        ScopeLock s(Gmux);
+        readEnv();
+        consumer=true;
+    }
+    string lastName;
+    while(!die.stopRequested()){
+        Gmux.lock();
+        ShowMode m=mode;
+        //deal with new windows
+        vector<pair<string,int> > created;
+        if(m==SHOW_WINDOWS){
+            for(map<string,ShowWindow>::iterator it=windows.begin();it!=windows.end();it++){
+                if(it->second.propFresh){
+                    created.push_back(make_pair(it->first,it->second.prop));
+                    it->second.propFresh=false;
+                }
+            }
         }
-        if (ready){//deal with imshows
-            Gmux.lock();
-            assert(nameShow.size()>0);
-            mat=take(toShow);
-            string name=take(nameShow);
-            Vec2d autoscale=take(autoScale);
-            ready--;
+        map<string,ShowWindow>::iterator it=nextFresh(lastName);
+        if(it!=windows.end()){//deal with imshows
+            string name=it->first;
+            Mat mat=it->second.mat;
+            it->second.mat.release();
+            Vec2d autoscale=it->second.autoscale;
+            it->second.fresh=false;
+            int n=it->second.written++;
             Gmux.unlock();
-            if ((autoscale[0]==autoscale[1] && autoscale[0]==0)){
-                double min; 
-                double max;
-                cv::minMaxIdx(mat, &min, &max);
-                float scale = 1.0/ (max-min);
-                mat.convertTo(mat,CV_MAKETYPE(CV_32F,mat.channels()), scale, -min*scale);
-//                 cout<<name<<": view scale: "<<max-min<<endl;
-//                 cout<<name<<": min: "<<min<<"  max: "<< max<<endl;
-            }else if (autoscale[0]!=autoscale[1]){
-                double scale= 1.0/(autoscale[1]-autoscale[0]);
-                mat.convertTo(mat,CV_MAKETYPE(mat.type(),mat.channels()),scale,-autoscale[0]*scale);
+            lastName=name;
+            PROFILE_ZONE("gui draw");
+            for(size_t i=0;i<created.size();i++)
+                namedWindow(created[i].first,created[i].second);
+            if(m==SHOW_OFF)
+                continue;
+            render(mat,autoscale);
+            if(m==SHOW_FILES){
+                string file=fileName(name,n);
+                if(!imwrite(file,mat))
+                    cerr<<"pfShow: could not write "<<file<<endl;
+                continue;
             }
-            mat.convertTo(mat,CV_MAKETYPE(CV_8U,mat.channels()), 255.0);//use 8 bit so we can have the nice mouse over
             if(mat.rows<250){
                 name+=":small";
                 namedWindow(name, cv::WINDOW_KEEPRATIO | cv::WINDOW_GUI_NORMAL);
             }
             imshow( name, mat);
             waitKey(1);//waitkey must occur here so matrix doesn't fall out of scope because imshow is dumb that way :(
-//            cout<<name<<" queue:"<<ready<<endl;
-        }else if(pausing){
+        }else if(m==SHOW_WINDOWS && pausing){
+            Gmux.unlock();
+            for(size_t i=0;i<created.size();i++)
+                namedWindow(created[i].first,created[i].second);
             namedWindow("control",cv::WINDOW_KEEPRATIO);
             cout<<"Paused: Space (in GUI window) to continue"<<endl;
-            while(waitKey()!=' ');
-            
-            CV_XADD(&pausing,-1);
-        }else{
-            waitKey(1);
-        }
-        if(pausing<0){
-            pausing=0;
+            while(waitKey(100)!=' ' && !die.stopRequested());
+            ScopeLock s(Gmux);
+            if(pausing>0)
+                pausing--;
+            Gcond.broadcast();
+        }else if(m==SHOW_WINDOWS){
+            Gmux.unlock();
+            for(size_t i=0;i<created.size();i++)
+                namedWindow(created[i].first,created[i].second);
+            waitKey(10);//keep the windows responsive
+        }else{//nothing to pump, sleep until there is a frame
+            if(!die.stopRequested())
+                Gcond.wait(Gmux);
+            Gmux.unlock();
         }
-//         waitKey(1);
-//         usleep(100);
     }
-    allDie=1;
+    {
+        ScopeLock s(Gmux);
+        consumer=false;
+        windows.clear();
+    }
+    allDie.requestStop();
+    {
+        ScopeLock s(Gmux);
+        Gcond.broadcast();//gpause and gcheck waiters
+    }
     cout<<"Gui Shutting down"<<endl;
-    waitKey(1);
+    if(mode==SHOW_WINDOWS)
+        waitKey(1);
 }
 void initGui(){
-    ImplThread::startThread(guiLoop,"Graphics"); 
-    
-}
+    ImplThread::startThread(guiLoop,"Graphics");
 
+}
+#endif
@@ -3,11 +3,40 @@
 #include <string>
 #include <opencv2/core/mat.hpp>
 #include <utils/ImplThreadLaunch.hpp>
+//Debug views. pfShow never waits for the gui: a window gets at most one
+// frame per interval (pfShowRate), a newer frame replaces one not yet
+// drawn, and with no gui thread running or the sink off the call returns
+// at once. Where a view costs work to build, ask pfShowing(name) first.
+//
+// The sink is picked at runtime with pfShowMode or the environment:
+//   DTAM_SHOW=off | windows | files:DIR   (default windows)
+//   DTAM_SHOW_HZ=10                       frames per second per window, 0 unlimited
+// files writes DIR/<window>_000000.png, ... instead of opening windows.
+// Building with DTAM_NO_GUI compiles all of it away.
+enum ShowMode{
+    SHOW_OFF,
+    SHOW_WINDOWS,
+    SHOW_FILES
+};
+#ifndef DTAM_NO_GUI
 void pfShow(const std::string name,const cv::Mat& _mat, int defaultscale=0,cv::Vec2d autoscale=cv::Vec2d(0,0));
 void pfWindow(const std::string name,int prop);
-void* guiLoop(void*);
+bool pfShowing(const std::string& name="");//would a frame for name be taken now
+void pfShowMode(ShowMode mode,const std::string& dir=".");
+void pfShowRate(double hz,const std::string& name="");//empty name: the default for all
+void guiLoop(StopToken& die);
 void initGui();
-void gpause();
+void gpause(StopToken* stop=NULL);//only pauses with windows to press space in, stop ends it too
 void gcheck();
-extern int allDie;
+#else
+inline void pfShow(const std::string,const cv::Mat&, int=0,cv::Vec2d=cv::Vec2d(0,0)){}
+inline void pfWindow(const std::string,int){}
+inline bool pfShowing(const std::string& name=""){return false;}
+inline void pfShowMode(ShowMode,const std::string& dir="."){}
+inline void pfShowRate(double,const std::string& name=""){}
+inline void initGui(){}
+inline void gpause(StopToken* =NULL){}
+inline void gcheck(){}
+#endif
+extern StopToken allDie;
 #endif
@@ -10,7 +10,7 @@
 #include "CostVolume/CostVolume.hpp"
 #include "Optimizer/Optimizer.hpp"
 #include "DepthmapDenoiseWeightedHuber/DepthmapDenoiseWeightedHuber.hpp"
-// #include "OpenDTAM.hpp"
+#include "OpenDTAM.hpp"
 #include "graphics.hpp"
 #include "set_affinity.h"
 #include "Track/Track.hpp"
@@ -19,9 +19,9 @@
 #include "apriltag/tagStandard41h12.h"
 
 #include "utils/utils.hpp"
+#include "utils/ImageStream.hpp"
 
 //debug
-#include "tictoc.h"
 
 const static bool valgrind=0;
 
@@ -32,6 +32,33 @@ using namespace std;
 
 int App_main( int argc, char** argv );
 
+//Pose of the first tag seen in gray, as the world to camera R,T
+static bool tagPose(apriltag_detector_t* td,const Mat& K,const Mat& gray,Mat& R,Mat& T){
+    image_u8_t im={gray.cols,gray.rows,(int32_t)gray.step,gray.data};//wraps the stream's decode, no second read
+    zarray_t *detections = apriltag_detector_detect(td, &im);
+    bool found=zarray_size(detections) > 0;
+    if (found) {
+        apriltag_detection_t *det;
+        zarray_get(detections, 0, &det);
+        apriltag_detection_info_t info;
+        info.det = det;
+        info.tagsize = 0.02; //TODO: Change as needed
+        info.fx = K.at<double>(0,0);
+        info.fy = K.at<double>(1,1);
+        info.cx = K.at<double>(0,2);
+        info.cy = K.at<double>(1,2);
+        apriltag_pose_t pose;
+        estimate_tag_pose(&info, &pose);
+        Mat(3, 3, CV_64FC1, pose.R->data).copyTo(R);
+        Mat(3, 1, CV_64FC1, pose.t->data).copyTo(T);
+        // Free everything to prevent memory leaks
+        matd_destroy(pose.R);
+        matd_destroy(pose.t);
+    }
+    apriltag_detections_destroy(detections);
+    return found;
+}
+
 void myExit(){
     ImplThread::stopAllThreads();
 }
@@ -52,7 +79,6 @@ int App_main( int argc, char** argv )
     pthread_setname_np(pthread_self(),"App_main");
 #endif
 
-    char filename[500];
     Mat image, cameraMatrix, R, T;
     vector<Mat> images,Rs,Ts,Rs0,Ts0;
     Mat ret;//a place to return downloaded images to
@@ -64,68 +90,25 @@ int App_main( int argc, char** argv )
 	apriltag_family_t *tf = tagStandard41h12_create();
 	apriltag_detector_add_family(td, tf);
 
-    for(int i=0;i<numImg;i++){
-        Mat tmp;
-        sprintf(filename,"%s/scene_%03d.jpg",argv[1],i);
-//        sprintf(filename,"../../Trajectory_30_seconds/scene_%03d.png",i);
-        //convertAhandaPovRayToStandard(argv[1],
-        //                              i,
-        //                              cameraMatrix,
-        //                              R,
-        //                              T);
-		// Try to detect an April tag
-		
-		// From our opencv undistort
-		cameraMatrix.data = {392.31866455, 0, 314.93378122,
-							 0, 522.89459229, 251.50994903,
-							 0, 0, 1};
-        Mat image;
-        cout<<"Opening: "<< filename << endl;
-        
-        imread(filename, -1).convertTo(image,CV_32FC3,1.0/65535.0);
-        resize(image,image,Size(),reconstructionScale,reconstructionScale);
-        
-		img_u8_t* byte_image = image_u8_create_from_pnm(filename); 
-		zarray_t *detections = apriltag_detector_detect(td, byte_image);
-		
-		Mat R = Mat(3, 3, CV_64FC1);
-		Mat t = Mat(3, 1, CV_64FC1);
-		if (zarray_size(detections) > 0) {
-			for (int i = 0; i < 1; i++) {
-		    	apriltag_detection_t *det;
-			    zarray_get(detections, i, &det);
-
-		    // Do stuff with detections here.
-				apriltag_detection_info_t info;
-				info.det = det;
-				info.tagsize = 0.02; //TODO: Change as needed
-				info.fx = 392.31866455;
-				info.fy = 522.89459229;
-				info.cx = 314.93378122;
-				info.cy = 251.50994903;
-				apriltag_pose_t pose;
-				estimate_tag_pose(&info, &pose);
-			}	
-			matd_t *pR = pose.R;
-			R = Mat(2, {R->nrows, R->ncols}, CV_64FC1, pR->data);
-			matd_t *pt = pose.t;
-			t = Mat(2, {t->nrows, t->ncols}, CV_64FC1, pt->data);
-			cout << "Retrieved pose from Apriltag in image " << i << endl;
- 
-        images.push_back(image.clone());
-        Rs.push_back(R.clone());
-        Ts.push_back(T.clone());
-        Rs0.push_back(R.clone());
-        Ts0.push_back(T.clone());
+    bool pipeline=argc>2 && string(argv[2])=="pipeline";
 
-		// Free everything to prevent memory leaks
-		matd_destroy(pR);
-		matd_destroy(pt);
-		image_u8_destroy(byte_image);
-		apriltag_detections_destroy(detections);
+    //Ahanda's synthetic sequences (scene_%03d.png) come with their poses in
+    // scene_%03d.txt, anything else is posed by the AprilTag in view
+    AhandaTrajectory truth;
+    AhandaTrajectory::Status truthStatus=truth.load(argv[1],0,pipeline?-1:numImg);
+    bool ahanda=truthStatus==AhandaTrajectory::OK;
+    if(truthStatus==AhandaTrajectory::MISSING_FILE || truthStatus==AhandaTrajectory::PARSE_ERROR){
+        cout<<"Ahanda poses unusable ("<<truth.error()<<"), falling back to tags"<<endl;
     }
-    HostMem cret(images[0].rows,images[0].cols,CV_32FC1);
-    ret=cret.createMatHeader();
+
+    // From our opencv undistort
+    cameraMatrix=(Mat)(Mat_<double>(3,3) << 392.31866455, 0, 314.93378122,
+                                             0, 522.89459229, 251.50994903,
+                                             0, 0, 1);
+    if(ahanda)
+        cameraMatrix=truth.cameraMatrix();
+    Mat tagCamera=cameraMatrix.clone();//tags are found at full resolution
+
     //Setup camera matrix
     double sx=reconstructionScale;
     double sy=reconstructionScale;
@@ -139,25 +122,78 @@ int App_main( int argc, char** argv )
     cameraMatrix-=(Mat)(Mat_<double>(3,3) <<    0.0,0.0,0.5,
                                                 0.0,0.0,0.5,
                                                 0.0,0.0,0);
+
+    //decoded a few frames ahead on the task pool, straight to CV_32FC3 at the reconstruction scale.
+    // The pipeline runs the whole sequence, however long.
+    ImageStream stream(string(argv[1])+(ahanda ? "/scene_%03d.png" : "/scene_%03d.jpg"),0,pipeline?-1:numImg,reconstructionScale,!ahanda);
+    StreamImage in;
+    auto framePose=[&](const StreamImage& in,Mat& R,Mat& T)->bool{
+        if(ahanda)
+            return truth.pose(in.index-truth.first(),R,T);
+        return tagPose(td,tagCamera,in.gray,R,T);
+    };
+
+    if(pipeline){
+        //New Way: the threaded CPU pipeline, poses come back while maps build.
+        // Frames are streamed, only the look-ahead window is ever resident.
+        OpenDTAM odm(cameraMatrix);
+        int posed=0;
+        while(stream.next(in)){
+            if(in.image.empty()){
+                cout<<"Could not read "<<in.path<<endl;
+                continue;
+            }
+            if(posed<2){//seed the map with two posed frames
+                if(framePose(in,R,T)){
+                    odm.addFrameWithPose(in.image,R,T);
+                    if(++posed==2)
+                        odm.seedDone();
+                }
+                continue;
+            }
+            odm.addFrame(in.image);
+            Ptr<Frame> f;
+            while(odm.tryPopTracked(f)){
+                cout<<"Frame "<<f->fid<<(f->reg3d?" tracked: ":" lost: ")<<f->T.t()<<endl;
+            }
+            usleep(33000);//camera rate
+        }
+        tagStandard41h12_destroy(tf);
+        apriltag_detector_destroy(td);
+        return 0;
+    }
+
+    //Old Way revisits earlier frames, so it keeps the tag posed ones
+    while(stream.next(in)){
+        cout<<"Opening: "<< in.path << endl;
+        if(in.image.empty() || !framePose(in,R,T))
+            continue;
+        cout << "Retrieved pose for image " << in.index << (ahanda ? " from its scene file" : " from Apriltag") << endl;
+        images.push_back(in.image);
+        Rs.push_back(R.clone());
+        Ts.push_back(T.clone());
+        Rs0.push_back(R.clone());
+        Ts0.push_back(T.clone());
+    }
+    numImg=images.size();
+    if(numImg<2){
+        cout<<"Need at least two posed images (a visible tag or a scene file)"<<endl;
+        return 1;
+    }
+    HostMem cret(images[0].rows,images[0].cols,CV_32FC1);
+    ret=cret.createMatHeader();
+
     int layers=32;
     int imagesPerCV=20;
     CostVolume cv(images[0],(FrameID)0,layers,0.015,0.0,Rs[0],Ts[0],cameraMatrix);;
 
-//     //New Way (Needs work)
-//     OpenDTAM odm(cameraMatrix);
-//     odm.addFrameWithPose(images[0],Rs[0],Ts[0]);
-//     odm.addFrameWithPose(images[10],Rs[10],Ts[10]);
-//     for (int imageNum=2;imageNum<=numImg;imageNum++){
-//         odm.addFrame(images[imageNum]);
-//         usleep(100000);
-//     }
-    
     //Old Way
     int imageNum=0;
     
     int inc=1;
     
     cv::cuda::Stream s;
+    int prepared=-1;//next image, already converting for the cost volume
     
     for (int imageNum=1;imageNum<numImg;imageNum++){
         if (inc==-1 && imageNum<4){
@@ -168,8 +204,11 @@ int App_main( int argc, char** argv )
         image=images[imageNum];
 
         if(cv.count<imagesPerCV){
-            
-            cv.updateCost(image, R, T);
+            int current=prepared>=0 ? prepared : cv.prepareImage(image);
+            prepared=-1;
+            if(cv.count+1<imagesPerCV && imageNum+1<numImg)
+                prepared=cv.prepareImage(images[imageNum+1]);//converts while this one updates
+            cv.updateCost(current, R, T);
             cudaDeviceSynchronize();
 //             gpause();
 //             for( int i=0;i<layers;i++){
@@ -0,0 +1,134 @@
+#include "ImageStream.hpp"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <functional>
+
+using namespace cv;
+using namespace std;
+
+ImageStream::ImageStream(const string& _pattern,int _first,int _count,double _scale,bool gray,int window):
+    pattern(_pattern),
+    first(_first),
+    count(_count),
+    scale(_scale),
+    wantGray(gray),
+    slots(window>0 ? window : 1),
+    nextIndex(_first),
+    submitted(_first),
+    end(-1)
+    {
+        ScopeLock s(mutex);
+        while(submitted<first+(int)slots.size() && inRange(submitted))
+            submit(submitted);
+    }
+
+ImageStream::~ImageStream(){
+    TaskPool::global().wait(inflight);
+}
+
+//mutex held
+void ImageStream::submit(int index){
+    slots[index%slots.size()].state=SLOT_DECODING;
+    submitted=index+1;
+    TaskPool::global().submit(std::bind(&ImageStream::decode,this,index),TASK_MAP,&inflight);
+}
+
+//mutex held. Read slots take the next indices in order, as long as the
+// caller has let go of their image. force also takes nextIndex's slot while
+// the caller holds it, next() can't wait for that.
+void ImageStream::refill(bool force){
+    while(inRange(submitted)){
+        Slot& slot=slots[submitted%slots.size()];
+        const Mat& im=slot.data.image;
+        bool free=!im.u || im.u->refcount==1;
+        if(slot.state!=SLOT_READ || !(free || (force && submitted==nextIndex)))
+            return;
+        submit(submitted);
+    }
+}
+
+bool ImageStream::next(StreamImage& out){
+    out=StreamImage();//the last image, if out held one, can be written over now
+    ScopeLock s(mutex);
+    if(!inRange(nextIndex) || (end>=0 && nextIndex>=end))
+        return false;
+    refill(true);
+    Slot& slot=slots[nextIndex%slots.size()];
+    while(slot.state!=SLOT_READY){
+        ready.wait(mutex);
+    }
+    if(count<0 && slot.data.image.empty()){//end of an uncounted sequence
+        end=nextIndex;
+        return false;
+    }
+    out=slot.data;
+    slot.state=SLOT_READ;
+    nextIndex++;
+    refill(false);
+    return true;
+}
+
+//JPEG can decode at 1/2, 1/4 and 1/8 size directly, far cheaper than decoding and resizing
+static int reducedFlag(const string& path,double scale){
+    size_t dot=path.rfind('.');
+    string ext=dot==string::npos ? string() : path.substr(dot+1);
+    if(ext!="jpg" && ext!="jpeg" && ext!="JPG" && ext!="JPEG")
+        return -1;
+    if(scale==.5)
+        return IMREAD_REDUCED_COLOR_2;
+    if(scale==.25)
+        return IMREAD_REDUCED_COLOR_4;
+    if(scale==.125)
+        return IMREAD_REDUCED_COLOR_8;
+    return -1;
+}
+
+//Runs on the pool. The slot is this task's alone until it is marked ready.
+void ImageStream::decode(int index){
+    char path[600];
+    snprintf(path,sizeof(path),pattern.c_str(),index);
+    Slot& slot=slots[index%slots.size()];
+    StreamImage& data=slot.data;
+    data.index=index;
+    data.path=path;
+    data.gray.release();
+
+    double s=scale;
+    int flags=IMREAD_ANYDEPTH|IMREAD_ANYCOLOR;
+    int reduced=wantGray ? -1 : reducedFlag(data.path,scale);//tags want full resolution
+    if(reduced>=0){
+        flags=reduced;
+        s=1.0;
+    }
+    Mat raw=imread(data.path,flags);
+    if(raw.empty()){
+        data.image.release();
+    }else{
+        int cn=raw.channels();
+        if(wantGray){
+            Mat g=raw;
+            if(cn!=1)
+                cvtColor(raw,g,cn==4 ? COLOR_BGRA2GRAY : COLOR_BGR2GRAY);
+            if(g.depth()==CV_8U)
+                data.gray=g;
+            else
+                g.convertTo(data.gray,CV_8U,g.depth()==CV_16U ? 1/256.0 : 255.0);
+        }
+        Mat c=raw;
+        if(cn==1)
+            cvtColor(raw,c,COLOR_GRAY2BGR);
+        else if(cn==4)
+            cvtColor(raw,c,COLOR_BGRA2BGR);
+        if(s!=1.0)
+            resize(c,c,Size(),s,s);//before converting, fewer bytes to move
+        double alpha=c.depth()==CV_8U ? 1/255.0 : c.depth()==CV_16U ? 1/65535.0 : 1.0;
+        if(data.image.u && data.image.u->refcount>1)
+            data.image.release();//the caller still has the last one, don't write into it
+        c.convertTo(data.image,CV_32F,alpha);
+    }
+
+    ScopeLock l(mutex);
+    slot.state=SLOT_READY;
+    ready.broadcast();
+}
@@ -0,0 +1,71 @@
+#ifndef IMAGE_STREAM_HPP
+#define IMAGE_STREAM_HPP
+//Reads a numbered image sequence (scene_000.png, scene_001.png, ...) a few
+// frames ahead of the caller instead of all of it up front.
+//
+// Each image is decoded on TaskPool::global() and converted once, straight
+// to what OpenDTAM takes: CV_32FC3 in [0,1] at the reconstruction scale,
+// whatever the file's depth and channels. Optionally also an 8 bit gray
+// image at full resolution from the same decode, for AprilTag detection.
+// At most window images are decoded or waiting at any time, so memory
+// does not grow with the sequence, and next() returns as soon as the
+// image it asks for is ready.
+// A slot takes its next image once the caller has let go of the last one,
+// so its float buffer is decoded into again. Pass the same StreamImage to
+// every next(), it drops the image it held first. Images kept past that
+// are not written over, their slot decodes into a new buffer instead.
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "Scheduler/ImplMutex.hpp"
+#include "Scheduler/TaskPool.hpp"
+
+struct StreamImage{
+    int index;
+    std::string path;
+    cv::Mat image;//CV_32FC3 in [0,1], empty if the file could not be read
+    cv::Mat gray; //CV_8UC1, full resolution, if asked for
+};
+
+class ImageStream{
+public:
+    //pattern has one printf %d for the index, e.g. "dir/scene_%03d.png".
+    // count<0 reads until the first missing file.
+    ImageStream(const std::string& pattern,int first=0,int count=-1,double scale=1.0,bool gray=false,int window=4);
+    ~ImageStream();//waits for the decodes in flight
+
+    //Next image in order, false past the end. An unreadable file inside a
+    // counted sequence comes back with image empty.
+    bool next(StreamImage& out);
+
+private:
+    enum{SLOT_DECODING,SLOT_READY,SLOT_READ};//READ: handed to the caller, reused once it lets go
+    struct Slot{
+        int state;
+        StreamImage data;
+    };
+
+    void submit(int index);
+    void refill(bool force);
+    void decode(int index);
+    bool inRange(int index) const{
+        return count<0 || index<first+count;
+    }
+
+    std::string pattern;
+    int first,count;
+    double scale;
+    bool wantGray;
+    std::vector<Slot> slots;//index i lives in slots[i%window]
+    int nextIndex;          //what next() returns next
+    int submitted;          //one past the last index handed to the pool
+    int end;                //first missing index of an uncounted sequence, or -1
+    ImplMutex mutex;
+    ImplCondVar ready;
+    TaskGroup inflight;
+
+    ImageStream(const ImageStream&);
+    ImageStream& operator = (const ImageStream&);
+};
+
+#endif
@@ -1,55 +1,99 @@
 #if !defined WIN32 && !defined WINCE
 #  include "ImplThreadLaunch.hpp"
+#  include <time.h>
+#  include <vector>
 
 using namespace std;
 namespace ImplThread{
     ImplMutex mutex;
-    std::map<const pthread_t,int* > mymap;
-    void stopAllThreads(){
-        mutex.lock();
-        using namespace ImplThread;
-        for ( std::map<const pthread_t,int*>::iterator it=mymap.begin(); it!=mymap.end();it++){
-            pthread_t thread_id=it->first;
-            *(it->second)=1;
-            cout<<" Thread Stop: "<< thread_id<<":"<<it->second<< endl;
-            
-            timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += 5;//5 sec timeout
-            if(pthread_timedjoin_np(thread_id,NULL,&ts))
-                pthread_cancel(thread_id);
-            
-//             it=mymap.begin();
+    std::map<const pthread_t,Entry> mymap;
+
+    static timespec deadline(double timeout){
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);//pthread_timedjoin_np's clock
+        long long ns=ts.tv_nsec+(long long)(timeout*1e9);
+        ts.tv_sec+=ns/1000000000;
+        ts.tv_nsec=ns%1000000000;
+        return ts;
+    }
+    //Token already stopped, so this only waits for the thread to notice
+    static bool join(pthread_t thread_id,const Entry& e,const timespec& until){
+        if(pthread_timedjoin_np(thread_id,NULL,&until)){
+            cerr<<" Thread "<<e.name<<" ("<<thread_id<<") did not stop in time, detaching it"<<endl;
+            pthread_detach(thread_id);//it may still use its token, so that is not freed
+            return false;
+        }
+        if(e.owned)
+            delete e.token;
+        return true;
+    }
+
+    void registerThread(pthread_t thread,StopToken* token,bool owned,const std::string& name){
+        ScopeLock s(mutex);
+        Entry e;
+        e.token=token;
+        e.owned=owned;
+        e.name=name;
+        mymap[thread]=e;
+    }
+
+    bool stopThread(pthread_t thread_id,double timeout){
+        Entry e;
+        {
+            ScopeLock s(mutex);
+            if(!mymap.count(thread_id))
+                return true;
+            e=mymap.at(thread_id);
+            mymap.erase(thread_id);
         }
-         mymap.erase(mymap.begin(),mymap.end());
-         mutex.unlock();
+        cout<<" Thread Stop: "<<e.name<<" : "<< thread_id<< endl;
+        e.token->requestStop();
+        return join(thread_id,e,deadline(timeout));
     }
-    void*LAUNCH_THREAD(void* in){
-        std::pair<void (*)(int*),int* >* p=(std::pair<void (*)(int*),int* >*)in;
-        void (*func)(int*)=p->first;
-        cout<<" Thread Start: "<< p->second<< endl;
-        func(p->second);
-        
+
+    bool stopAllThreads(double timeout){
+        vector<pair<pthread_t,Entry> > all;
+        {
+            ScopeLock s(mutex);
+            all.assign(mymap.begin(),mymap.end());
+            mymap.clear();
+        }
+        //stop all first, so they wind down in parallel
+        for(size_t i=0;i<all.size();i++){
+            cout<<" Thread Stop: "<<all[i].second.name<<" : "<< all[i].first<<":"<<all[i].second.token<< endl;
+            all[i].second.token->requestStop();
+        }
+        timespec until=deadline(timeout);
+        bool ok=true;
+        for(size_t i=0;i<all.size();i++)
+            ok&=join(all[i].first,all[i].second,until);
+        return ok;
+    }
+
+    struct Launch{
+        void (*func)(StopToken&);
+        StopToken* stop;
     };
-    unsigned int startThread(void (*_func)(int*) , const std::string& _name,int affinity){
-        mutex.lock();
-        int* stopp=new int(0);
+    static void*LAUNCH_THREAD(void* in){
+        Launch* p=(Launch*)in;
+        cout<<" Thread Start: "<< p->stop<< endl;
+        p->func(*p->stop);
+        delete p;
+        return NULL;
+    }
+    pthread_t startThread(void (*_func)(StopToken&) , const std::string& _name,int affinity){
+        Launch* in=new Launch;
+        in->func=_func;
+        in->stop=new StopToken;
+        StopToken* stopp=in->stop;
         pthread_t thread;
-        void* in=new std::pair<void (*)(int*),int* >(_func,stopp);
-        
+
         pthread_create( &thread, NULL,LAUNCH_THREAD, in);
         pthread_setname_np(thread,_name.c_str());
-        if (affinity>0){
-            cpu_set_t cpuset;
-            CPU_ZERO(&cpuset);
-            static int cores=cv::getNumberOfCPUs();
-            CPU_SET(affinity%cores, &cpuset);
-            pthread_setaffinity_np(thread,1, &cpuset);
-        }
+        if (affinity>0 && !Placement::global().pin(affinity,thread))
+            cerr<<" Thread "<<_name<<" could not be pinned to CPU "<<Placement::global().cpu(affinity)<<endl;
         cout<<" Thread Requested: "<<_name<<" : "<<thread<<":"<< stopp<< endl;
-        mymap[thread]=stopp;
-        
-        mutex.unlock();
+        registerThread(thread,stopp,true,_name);
         return thread;
     }
 }
@@ -5,78 +5,76 @@
 #  include <pthread.h>
 #  include <opencv2/core/core.hpp>
 #  include <map>
+#  include <string>
 #  include <iostream>
 #include <Scheduler/ImplMutex.hpp>
+#include <Scheduler/Placement.hpp>
+#include <Scheduler/StopToken.hpp>
+//Every thread gets a StopToken, its own or one shared by the caller's
+// threads. Stopping requests it, which wakes the thread wherever it blocks
+// on a primitive tied to the token, and then joins for at most timeout
+// seconds. A thread still running after that is reported by name and
+// detached, so shutdown never hangs on it; the false result tells the
+// caller it must not free anything that thread may still use.
 namespace ImplThread{
-    extern std::map<const pthread_t,int* > mymap;
+    struct Entry{
+        StopToken* token;
+        bool owned;//created by startThread, freed once the thread is joined
+        std::string name;
+    };
+    extern std::map<const pthread_t,Entry> mymap;
     extern ImplMutex mutex;
-    void stopAllThreads();
-    unsigned int startThread(void (*_func)(int*) , const std::string& _name="ODMThread",int affinity=-1);
+    bool stopAllThreads(double timeout=5.0);//one deadline for all of them, false if any was left running
+    bool stopThread(pthread_t thread_id,double timeout=5.0);//false if it was left running
+    pthread_t startThread(void (*_func)(StopToken&) , const std::string& _name="ODMThread",int affinity=-1);
+    void registerThread(pthread_t thread,StopToken* token,bool owned,const std::string& name);
 }
 template <typename Object>
 class ImplThreadLauncher{
-    
+
     struct Pass{
         std::string name;
         int cpuid;
-        void (Object::*func)(int*);
+        void (Object::*func)(StopToken&);
         Object* instance;
-        int * stop;
+        StopToken* stop;
     };
-    
-    
+
+
     static void* launch (void* data){
         Pass* pass=(Pass*)data;
         pthread_setname_np(pthread_self(),pass->name.c_str());
-        if (pass->cpuid>0){
-            set_affinity(pass->cpuid);
-        }
+        if (pass->cpuid>0 && !Placement::global().pin(pass->cpuid))//cpuid counts CPUs this process may use
+            std::cerr<<" Thread "<<pass->name<<" could not be pinned to CPU "<<Placement::global().cpu(pass->cpuid)<<std::endl;
         Object* object=(Object*)pass->instance;
 
-        (object->*(pass->func))(pass->stop);
+        (object->*(pass->func))(*pass->stop);
         delete pass;
+        return NULL;
     }
-    
-    static void set_affinity(int cpuid){
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        static int cores=cv::getNumberOfCPUs();
-        CPU_SET(cpuid%cores, &cpuset);
-        pthread_setaffinity_np(pthread_self(),1, &cpuset);
-    }
-    
-    
+
+
 public:
-    static unsigned int startThread(Object& object,void (Object::*_func)(int*), const std::string& _name="ODMThread",int affinity=-1){
-        ImplThread::mutex.lock();
-        using namespace ImplThread;
+    //token=NULL gives the thread a token of its own
+    static pthread_t startThread(Object& object,void (Object::*_func)(StopToken&), const std::string& _name="ODMThread",int affinity=-1,StopToken* token=NULL){
         Pass* pass=new Pass;
         pass->name=_name;
         pass->cpuid=affinity;
         pass->func=_func;
         pass->instance=&object;
-        pass->stop=new int(0);
-        int* stopp=pass->stop;
+        pass->stop=token ? token : new StopToken;
+        StopToken* stopp=pass->stop;
         pthread_t thread;
-        
+
         pthread_create( &thread, NULL,launch, (void*) pass);
         std::cout<<" Thread Requested: "<<_name<<" : "<<thread<<":"<< stopp<< std::endl;
-        mymap[thread]=stopp;
-        ImplThread::mutex.unlock();
+        ImplThread::registerThread(thread,stopp,!token,_name);
         return thread;
     }
-    static void stopThread(unsigned int thread_id){
-        ImplThread::mutex.lock();
-        using namespace ImplThread;
-        if(mymap.count(thread_id)){
-            *mymap.at(thread_id)=1;
-            std::cout<<" Thread Stop: "<< thread_id<< std::endl;
-            pthread_join(thread_id,NULL);
-            mymap.erase(thread_id);   
-        }
-        ImplThread::mutex.unlock();
+    static bool stopThread(pthread_t thread_id,double timeout=5.0){
+        return ImplThread::stopThread(thread_id,timeout);
     }
-    
+
 };
 
 
@@ -85,4 +83,4 @@ public:
 #error OpenDTAM ImplThreadLauncher not implemented on this system
 #endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,303 @@
+#include "Profiler.hpp"
+#ifdef DTAM_PROFILE
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Scheduler/ImplMutex.hpp"
+#include "Trace.hpp"
+
+using namespace std;
+
+#define PROFILE_BUFFER 4096 //samples per thread between folds
+#define PROFILE_SUB 8       //histogram buckets per power of two
+#define PROFILE_BUCKETS (PROFILE_SUB+61*PROFILE_SUB)
+
+namespace Profiler{
+
+//log histogram: exact below PROFILE_SUB ns, then PROFILE_SUB buckets an octave
+static int bucketOf(uint64_t ns){
+    if(ns<PROFILE_SUB)
+        return ns;
+    int e=63-__builtin_clzll(ns);//>=3
+    int m=(ns>>(e-3))&(PROFILE_SUB-1);
+    return PROFILE_SUB+(e-3)*PROFILE_SUB+m;
+}
+static double bucketLow(int b){
+    if(b<PROFILE_SUB)
+        return b;
+    int e=(b-PROFILE_SUB)/PROFILE_SUB+3;
+    int m=(b-PROFILE_SUB)%PROFILE_SUB;
+    return ldexp(PROFILE_SUB+m,e-3);
+}
+
+struct Aggregate{
+    uint64_t count,total,min,max;
+    uint64_t hist[PROFILE_BUCKETS];
+    Aggregate(){
+        clear();
+    }
+    void clear(){
+        count=total=max=0;
+        min=~0ull;
+        memset(hist,0,sizeof(hist));
+    }
+    void add(uint64_t ns){
+        count++;
+        total+=ns;
+        if(ns<min)
+            min=ns;
+        if(ns>max)
+            max=ns;
+        hist[bucketOf(ns)]++;
+    }
+    double percentile(double q) const{
+        double target=q*count;
+        uint64_t below=0;
+        for(int b=0;b<PROFILE_BUCKETS;b++){
+            if(hist[b] && below+hist[b]>=target){
+                double lo=bucketLow(b),hi=bucketLow(b+1);
+                double v=lo+(hi-lo)*(target-below)/hist[b];
+                return v<min ? min : v>max ? max : v;
+            }
+            below+=hist[b];
+        }
+        return max;
+    }
+};
+
+struct Node{
+    int parent;
+    string name;
+    int depth;
+    Aggregate agg;
+};
+
+struct Sample{
+    int node;
+    uint64_t ns;
+};
+
+//One per thread. Only the owner appends; folding it into the totals or
+// reading it for a report happens under the registry lock, and only the
+// owner resets it, so the appends need no lock.
+struct ThreadLog{
+    atomic<int> count;
+    int skip;   //samples before this were dropped by reset()
+    int current;//the zone the thread is in, 0 at top level
+    vector<vector<pair<const char*,int> > > children;//node -> (name,child) seen here
+    Sample samples[PROFILE_BUFFER];
+    ThreadLog();
+    ~ThreadLog();
+    void fold();
+};
+
+struct Registry{
+    ImplMutex mutex;
+    deque<Node> nodes;//0 is the root
+    vector<ThreadLog*> logs;
+    Registry();
+};
+
+static void reportAtExit(){
+    const char* path=getenv("DTAM_PROFILE_REPORT");
+    if(path && !report(path))
+        cerr<<"Profiler: could not write "<<path<<endl;
+}
+
+Registry::Registry(){
+    Node root;
+    root.parent=-1;
+    root.depth=-1;
+    nodes.push_back(root);
+    atexit(reportAtExit);
+}
+
+//Never destroyed, threads still running at exit may use it
+static Registry& registry(){
+    static Registry* r=new Registry;
+    return *r;
+}
+
+//On the heap, the buffer is too big for every thread's static TLS
+static ThreadLog& threadLog(){
+    static thread_local unique_ptr<ThreadLog> log;
+    if(!log)
+        log.reset(new ThreadLog);
+    return *log;
+}
+
+ThreadLog::ThreadLog():count(0),skip(0),current(0){
+    Registry& r=registry();
+    ScopeLock s(r.mutex);
+    r.logs.push_back(this);
+}
+
+ThreadLog::~ThreadLog(){
+    Registry& r=registry();
+    fold();
+    ScopeLock s(r.mutex);
+    for(size_t i=0;i<r.logs.size();i++){
+        if(r.logs[i]==this){
+            r.logs.erase(r.logs.begin()+i);
+            break;
+        }
+    }
+}
+
+//by the owner
+void ThreadLog::fold(){
+    Registry& r=registry();
+    ScopeLock s(r.mutex);
+    int n=count.load(memory_order_relaxed);
+    for(int i=skip;i<n;i++)
+        r.nodes[samples[i].node].agg.add(samples[i].ns);
+    count.store(0,memory_order_relaxed);
+    skip=0;
+}
+
+int enter(const char* name){
+    ThreadLog& log=threadLog();
+    int parent=log.current;
+    if((int)log.children.size()<=parent)
+        log.children.resize(parent+1);
+    vector<pair<const char*,int> >& seen=log.children[parent];
+    int node=-1;
+    for(size_t i=0;i<seen.size();i++){
+        if(seen[i].first==name){
+            node=seen[i].second;
+            break;
+        }
+    }
+    if(node<0){//first time on this thread, the same name may be known from another
+        Registry& r=registry();
+        ScopeLock s(r.mutex);
+        for(size_t i=1;i<r.nodes.size() && node<0;i++){
+            if(r.nodes[i].parent==parent && r.nodes[i].name==name)
+                node=i;
+        }
+        if(node<0){
+            Node n;
+            n.parent=parent;
+            n.name=name;
+            n.depth=r.nodes[parent].depth+1;
+            node=r.nodes.size();
+            r.nodes.push_back(n);
+        }
+        seen.push_back(make_pair(name,node));
+    }
+    log.current=node;
+    return parent;
+}
+
+void leave(int parent,uint64_t startNs,const char* name){
+    uint64_t ns=nowNs()-startNs;
+    if(Trace::enabled())
+        Trace::complete(name,startNs,startNs+ns);
+    ThreadLog& log=threadLog();
+    int n=log.count.load(memory_order_relaxed);
+    log.samples[n].node=log.current;
+    log.samples[n].ns=ns;
+    log.count.store(n+1,memory_order_release);
+    log.current=parent;
+    if(n+1==PROFILE_BUFFER)
+        log.fold();
+}
+
+static bool emit(const vector<Aggregate>& aggs,const vector<vector<int> >& kids,
+                 const Registry& r,int node,const string& path,vector<ZoneStats>& out){
+    size_t at=out.size();
+    if(node>0){
+        const Aggregate& a=aggs[node];
+        ZoneStats z;
+        z.path=path;
+        z.depth=r.nodes[node].depth;
+        z.count=a.count;
+        z.total=a.total*1e-9;
+        z.min=a.count ? a.min*1e-9 : 0;
+        z.max=a.max*1e-9;
+        z.p50=a.percentile(.50)*1e-9;
+        z.p90=a.percentile(.90)*1e-9;
+        z.p99=a.percentile(.99)*1e-9;
+        out.push_back(z);
+    }
+    bool any=node>0 && aggs[node].count>0;
+    for(size_t i=0;i<kids[node].size();i++){
+        int c=kids[node][i];
+        any|=emit(aggs,kids,r,c,path.empty() ? r.nodes[c].name : path+"/"+r.nodes[c].name,out);
+    }
+    if(!any)
+        out.resize(at);//nothing timed here since the last reset
+    return any;
+}
+
+vector<ZoneStats> snapshot(){
+    Registry& r=registry();
+    ScopeLock s(r.mutex);
+    vector<Aggregate> aggs(r.nodes.size());
+    vector<vector<int> > kids(r.nodes.size());
+    for(size_t i=0;i<r.nodes.size();i++){
+        aggs[i]=r.nodes[i].agg;
+        if(i>0)
+            kids[r.nodes[i].parent].push_back(i);
+    }
+    for(size_t l=0;l<r.logs.size();l++){//what has not been folded yet
+        ThreadLog& log=*r.logs[l];
+        int n=log.count.load(memory_order_acquire);
+        for(int i=log.skip;i<n;i++)
+            aggs[log.samples[i].node].add(log.samples[i].ns);
+    }
+    vector<ZoneStats> out;
+    emit(aggs,kids,r,0,"",out);
+    return out;
+}
+
+void report(ostream& out){
+    vector<ZoneStats> zones=snapshot();
+    char line[256];
+    snprintf(line,sizeof(line),"%-40s %9s %11s %9s %9s %9s %9s %9s %9s",
+             "zone","count","total ms","mean ms","min","p50","p90","p99","max");
+    out<<line<<"\n";
+    for(size_t i=0;i<zones.size();i++){
+        const ZoneStats& z=zones[i];
+        size_t slash=z.path.rfind('/');
+        string name=string(2*z.depth,' ')+(slash==string::npos ? z.path : z.path.substr(slash+1));
+        snprintf(line,sizeof(line),"%-40s %9llu %11.3f %9.4f %9.4f %9.4f %9.4f %9.4f %9.4f",
+                 name.c_str(),(unsigned long long)z.count,z.total*1e3,z.count ? z.total*1e3/z.count : 0.0,
+                 z.min*1e3,z.p50*1e3,z.p90*1e3,z.p99*1e3,z.max*1e3);
+        out<<line<<"\n";
+    }
+    out.flush();
+}
+
+bool report(const string& path){
+    if(path=="stdout"){
+        report(cout);
+    }else if(path=="stderr"){
+        report(cerr);
+    }else{
+        ofstream f(path.c_str());
+        if(!f)
+            return false;
+        report(f);
+    }
+    return true;
+}
+
+void reset(){
+    Registry& r=registry();
+    ScopeLock s(r.mutex);
+    for(size_t i=0;i<r.nodes.size();i++)
+        r.nodes[i].agg.clear();
+    for(size_t l=0;l<r.logs.size();l++)
+        r.logs[l]->skip=r.logs[l]->count.load(memory_order_acquire);
+}
+
+}
+#endif
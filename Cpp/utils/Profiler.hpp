@@ -0,0 +1,99 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+//Scoped timing zones, replacing tic()/toc().
+//
+//   void Cost::optimizeQD(){
+//       PROFILE_ZONE("optimizeQD");
+//       ...
+//       {PROFILE_ZONE("q update"); ...}
+//
+// A zone is timed from the macro to the end of its scope. Zones opened
+// inside another one are its children, so the same name under different
+// parents is kept apart. Each thread appends to its own buffer without
+// locking; the buffer is folded into the shared totals when full, when
+// the thread exits, and whenever a report is made.
+//
+// Per zone: count, total, min, max and percentiles (p50/p90/p99, read off
+// a log histogram, within about 6%).
+// Profiler::report() prints the tree on demand. With DTAM_PROFILE_REPORT
+// set (a file name, or "stdout"/"stderr") it is also printed at exit.
+//
+// While Trace (utils/Trace.hpp) is recording, every zone is also a slice
+// on its thread's track.
+// Zone names must outlive the program, i.e. string literals.
+// Built without DTAM_PROFILE, the macro and the calls compile to nothing.
+#include <iosfwd>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+namespace Profiler{
+    inline uint64_t nowNs(){
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return (uint64_t)ts.tv_sec*1000000000ull+ts.tv_nsec;
+    }
+
+    //Always compiled in, for code that needs the time itself (budgets)
+    class Stopwatch{
+    public:
+        Stopwatch():start(nowNs()){}
+        void restart(){
+            start=nowNs();
+        }
+        double seconds() const{
+            return (nowNs()-start)*1e-9;
+        }
+    private:
+        uint64_t start;
+    };
+
+    struct ZoneStats{
+        std::string path;//"optimizeQD/q update"
+        int depth;       //0 for a top level zone
+        uint64_t count;
+        double total;    //seconds
+        double min,max;
+        double p50,p90,p99;
+    };
+
+#ifdef DTAM_PROFILE
+    int enter(const char* name);//returns the parent to restore
+    void leave(int parent,uint64_t startNs,const char* name);
+
+    std::vector<ZoneStats> snapshot();//depth first, children after their parent
+    void report(std::ostream& out);
+    bool report(const std::string& path);//"stdout", "stderr" or a file
+    void reset();
+#else
+    inline std::vector<ZoneStats> snapshot(){return std::vector<ZoneStats>();}
+    inline void report(std::ostream&){}
+    inline bool report(const std::string&){return true;}
+    inline void reset(){}
+#endif
+}
+
+#ifdef DTAM_PROFILE
+class ProfileZone{
+public:
+    explicit ProfileZone(const char* _name):name(_name),parent(Profiler::enter(_name)),start(Profiler::nowNs()){}
+    ~ProfileZone(){
+        Profiler::leave(parent,start,name);
+    }
+private:
+    const char* name;
+    int parent;
+    uint64_t start;
+
+    ProfileZone(const ProfileZone&);
+    ProfileZone& operator = (const ProfileZone&);
+};
+#define PROFILE_CAT2(a,b) a##b
+#define PROFILE_CAT(a,b) PROFILE_CAT2(a,b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CAT(profileZone,__LINE__)(name)
+#else
+#define PROFILE_ZONE(name) ((void)0)
+#endif
+
+#endif
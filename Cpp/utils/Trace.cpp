@@ -0,0 +1,227 @@
+#include "Trace.hpp"
+#include "Profiler.hpp"
+#include "Scheduler/ImplMutex.hpp"
+#include <vector>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+using namespace std;
+
+#define TRACE_CHUNK 4096     //events
+#define TRACE_MAX_CHUNKS 128 //per thread, about 20MB, later events are counted and dropped
+
+namespace Trace{
+
+std::atomic<bool> recording(false);
+
+struct Event{
+    const char* name;//or category, for flows
+    uint64_t ts;
+    uint64_t dur;
+    double value;
+    int id;
+    char ph;//Chrome's phase letter
+};
+
+//Appended by its thread only. count is the publication point: the writer
+// reads events below it, the owner never rewrites those.
+struct Chunk{
+    std::atomic<int> count;
+    std::atomic<Chunk*> next;
+    char threadName[16];//as of when the chunk was started
+    Event events[TRACE_CHUNK];
+    Chunk():count(0),next(NULL){
+        threadName[0]=0;
+        pthread_getname_np(pthread_self(),threadName,sizeof(threadName));
+    }
+};
+
+//Kept after its thread exits, until written
+struct Log{
+    Chunk* head;
+    Chunk* tail;//owner only
+    int chunks; //owner only
+    int tid;
+    std::atomic<uint64_t> dropped;
+};
+
+struct Registry{
+    ImplMutex mutex;
+    vector<Log*> logs;
+    std::atomic<uint64_t> origin;//ns, when recording first started
+    Registry():origin(0){}
+};
+
+//Never destroyed, the atexit write and late threads may use it
+static Registry& registry(){
+    static Registry* r=new Registry;
+    return *r;
+}
+
+static Log& threadLog(){
+    static thread_local Log* log=NULL;
+    if(!log){
+        log=new Log;
+        log->head=log->tail=new Chunk;
+        log->chunks=1;
+        log->dropped=0;
+        Registry& r=registry();
+        ScopeLock s(r.mutex);
+        log->tid=r.logs.size()+1;
+        r.logs.push_back(log);
+    }
+    return *log;
+}
+
+static Event* append(){
+    Log& log=threadLog();
+    int n=log.tail->count.load(std::memory_order_relaxed);
+    if(n==TRACE_CHUNK){
+        if(log.chunks==TRACE_MAX_CHUNKS){
+            log.dropped.fetch_add(1,std::memory_order_relaxed);
+            return NULL;
+        }
+        Chunk* c=new Chunk;
+        log.tail->next.store(c,std::memory_order_release);
+        log.tail=c;
+        log.chunks++;
+        n=0;
+    }
+    return &log.tail->events[n];
+}
+
+//after the event is filled in
+static void publish(){
+    Chunk* c=threadLog().tail;
+    c->count.store(c->count.load(std::memory_order_relaxed)+1,std::memory_order_release);
+}
+
+static void record(char ph,const char* name,uint64_t ts,uint64_t dur,double value,int id){
+    Event* e=append();
+    if(!e)
+        return;
+    e->ph=ph;
+    e->name=name;
+    e->ts=ts;
+    e->dur=dur;
+    e->value=value;
+    e->id=id;
+    publish();
+}
+
+void start(){
+    uint64_t zero=0;
+    registry().origin.compare_exchange_strong(zero,Profiler::nowNs());
+    recording.store(true);
+}
+
+void stop(){
+    recording.store(false);
+}
+
+void complete(const char* name,uint64_t startNs,uint64_t endNs){
+    if(enabled())
+        record('X',name,startNs,endNs-startNs,0,0);
+}
+
+void flowBegin(const char* cat,int id){
+    if(enabled())
+        record('s',cat,Profiler::nowNs(),0,0,id);
+}
+void flowStep(const char* cat,int id){
+    if(enabled())
+        record('t',cat,Profiler::nowNs(),0,0,id);
+}
+void flowEnd(const char* cat,int id){
+    if(enabled())
+        record('f',cat,Profiler::nowNs(),0,0,id);
+}
+
+void counter(const char* name,double value){
+    if(enabled())
+        record('C',name,Profiler::nowNs(),0,value,0);
+}
+
+//names are literals from this code base, but keep the JSON valid anyway
+static void putString(FILE* f,const char* s){
+    fputc('"',f);
+    for(;*s;s++){
+        if(*s=='"' || *s=='\\')
+            fputc('\\',f);
+        if((unsigned char)*s>=0x20)
+            fputc(*s,f);
+    }
+    fputc('"',f);
+}
+
+bool write(const string& path){
+    FILE* f=fopen(path.c_str(),"w");
+    if(!f)
+        return false;
+    Registry& r=registry();
+    ScopeLock s(r.mutex);//only holds off new threads, recording goes on
+    uint64_t origin=r.origin.load();
+    fprintf(f,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f,"{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"args\":{\"name\":\"OpenDTAM\"}}");
+    for(size_t l=0;l<r.logs.size();l++){
+        Log& log=*r.logs[l];
+        const char* name="";
+        uint64_t dropped=log.dropped.load(std::memory_order_relaxed);
+        for(Chunk* c=log.head;c;c=c->next.load(std::memory_order_acquire)){
+            if(c->threadName[0])
+                name=c->threadName;
+            int n=c->count.load(std::memory_order_acquire);
+            for(int i=0;i<n;i++){
+                const Event& e=c->events[i];
+                if(e.ts<origin)
+                    continue;//started before recording did
+                fprintf(f,",\n{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",e.ph,log.tid,(e.ts-origin)*1e-3);
+                switch(e.ph){
+                case 'X':
+                    fprintf(f,",\"dur\":%.3f,\"name\":",e.dur*1e-3);
+                    putString(f,e.name);
+                    break;
+                case 'C':
+                    fprintf(f,",\"name\":");
+                    putString(f,e.name);
+                    fprintf(f,",\"args\":{\"size\":%g}",e.value);
+                    break;
+                default://flows
+                    fprintf(f,",\"name\":");
+                    putString(f,e.name);
+                    fprintf(f,",\"cat\":");
+                    putString(f,e.name);
+                    fprintf(f,",\"id\":%d%s",e.id,e.ph=='s' ? "" : ",\"bp\":\"e\"");
+                }
+                fputc('}',f);
+            }
+        }
+        fprintf(f,",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":",log.tid);
+        putString(f,name);
+        fprintf(f,"}}");
+        if(dropped)
+            cerr<<"Trace: "<<dropped<<" events dropped on thread "<<name<<", its buffer was full"<<endl;
+    }
+    fprintf(f,"\n]}\n");
+    return fclose(f)==0;
+}
+
+static void writeAtExit(){
+    const char* path=getenv("DTAM_TRACE");
+    if(path && !write(path))
+        cerr<<"Trace: could not write "<<path<<endl;
+}
+
+//DTAM_TRACE records from load time
+static struct TraceFromEnv{
+    TraceFromEnv(){
+        if(getenv("DTAM_TRACE")){
+            start();
+            atexit(writeAtExit);
+        }
+    }
+} traceFromEnv;
+
+}
@@ -0,0 +1,63 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+//Timeline of the pipeline in Chrome trace-event JSON, for chrome://tracing
+// or ui.perfetto.dev: one track per thread (named as pthread_setname_np
+// named it), frames followed across threads as flow arrows, queue
+// occupancy as counters.
+//
+//   Trace::start();
+//   ...
+//   Trace::write("dtam.json");
+//
+// or run with DTAM_TRACE=dtam.json, which records from startup and writes
+// at exit.
+//
+// Slices come from every PROFILE_ZONE, and from TRACE_SCOPE where a slice
+// is wanted without the profiler. Each thread appends to its own chunked
+// buffer, publishing events with a release store, so recording takes no
+// lock; while not recording every call is a single relaxed load.
+// Names and categories must be string literals.
+#include <atomic>
+#include <string>
+#include <stdint.h>
+#include "Profiler.hpp"
+
+namespace Trace{
+    extern std::atomic<bool> recording;
+    inline bool enabled(){
+        return recording.load(std::memory_order_relaxed);
+    }
+    void start();
+    void stop();
+    bool write(const std::string& path);//what was recorded so far
+
+    void complete(const char* name,uint64_t startNs,uint64_t endNs);//a slice on this thread
+
+    //An arrow per id through the slices enclosing these calls, in time order.
+    // cat separates id spaces ("frame", "keyframe").
+    void flowBegin(const char* cat,int id);
+    void flowStep(const char* cat,int id);
+    void flowEnd(const char* cat,int id);
+
+    void counter(const char* name,double value);
+}
+
+class TraceScope{
+public:
+    explicit TraceScope(const char* _name):name(_name),start(Trace::enabled() ? Profiler::nowNs() : 0){}
+    ~TraceScope(){
+        if(start && Trace::enabled())
+            Trace::complete(name,start,Profiler::nowNs());
+    }
+private:
+    const char* name;
+    uint64_t start;
+
+    TraceScope(const TraceScope&);
+    TraceScope& operator = (const TraceScope&);
+};
+#define TRACE_CAT2(a,b) a##b
+#define TRACE_CAT(a,b) TRACE_CAT2(a,b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CAT(traceScope,__LINE__)(name)
+
+#endif
@@ -0,0 +1,144 @@
+// Free for non-commercial, non-military, and non-critical
+// use unless incorporated in OpenCV.
+// Inherits OpenCV Licence if in OpenCV.
+
+#ifndef DTAM_SE3_HPP
+#define DTAM_SE3_HPP
+#include <opencv2/core/core.hpp>
+#include <cmath>
+
+// Fixed size rigid body math. Everything lives in cv::Matx/cv::Vec, so none
+// of this touches the heap and it is safe to call per pixel or per iteration.
+//
+// Two 6 vector parameterizations are supported, both rotation first:
+//   fromLie/toLie: [rodrigues(R) | T], what the rest of DTAM calls "Lie"
+//                  parameters (the pose vectors in Track, Frame, etc.)
+//   exp/log:       the true se(3) exponential, [w | rho] with T=V(w)*rho
+// They share the rotation part and differ only in how T is stored.
+
+static inline cv::Matx33d se3_hat(const cv::Vec3d& w){
+    return cv::Matx33d(  0.0,-w[2], w[1],
+                        w[2],  0.0,-w[0],
+                       -w[1], w[0],  0.0);
+}
+
+struct SO3{
+    cv::Matx33d R;
+
+    SO3():R(cv::Matx33d::eye()){}
+    explicit SO3(const cv::Matx33d& _R):R(_R){}
+
+    //Rodrigues
+    static SO3 exp(const cv::Vec3d& w){
+        double th2=w.dot(w);
+        cv::Matx33d K=se3_hat(w);
+        double a,b;
+        if(th2<1e-16){//taylor, exact to double precision here
+            a=1.0-th2/6.0;
+            b=.5-th2/24.0;
+        }else{
+            double th=std::sqrt(th2);
+            a=std::sin(th)/th;
+            b=(1.0-std::cos(th))/th2;
+        }
+        return SO3(cv::Matx33d::eye()+a*K+b*(K*K));
+    }
+
+    cv::Vec3d log() const{
+        cv::Vec3d v(R(2,1)-R(1,2),R(0,2)-R(2,0),R(1,0)-R(0,1));//2*sin(th)*axis
+        double c=(R(0,0)+R(1,1)+R(2,2)-1.0)*.5;
+        c=c>1.0?1.0:(c<-1.0?-1.0:c);
+        double th=std::acos(c);
+        if(th<1e-8){
+            return .5*v;
+        }
+        if(CV_PI-th<1e-6){//near pi the antisymmetric part vanishes, use the symmetric part
+            int k=0;
+            if(R(1,1)>R(k,k)) k=1;
+            if(R(2,2)>R(k,k)) k=2;
+            cv::Vec3d n;
+            n[k]=std::sqrt((R(k,k)+1.0)*.5);
+            for(int i=0;i<3;i++){
+                if(i!=k) n[i]=(R(i,k)+R(k,i))/(4.0*n[k]);
+            }
+            if(n.dot(v)<0) n=-n;
+            return th*n;
+        }
+        return th/(2.0*std::sin(th))*v;
+    }
+
+    SO3 operator*(const SO3& B) const{return SO3(R*B.R);}
+    cv::Vec3d operator*(const cv::Vec3d& x) const{return R*x;}
+    SO3 inverse() const{return SO3(R.t());}
+};
+
+struct SE3{
+    SO3 rot;
+    cv::Vec3d t;
+
+    SE3():t(0,0,0){}
+    SE3(const SO3& _rot,const cv::Vec3d& _t):rot(_rot),t(_t){}
+    SE3(const cv::Matx33d& R,const cv::Vec3d& _t):rot(R),t(_t){}
+    explicit SE3(const cv::Matx44d& P)
+        :rot(cv::Matx33d(P(0,0),P(0,1),P(0,2),
+                         P(1,0),P(1,1),P(1,2),
+                         P(2,0),P(2,1),P(2,2))),
+         t(P(0,3),P(1,3),P(2,3)){}
+
+    static SE3 fromLie(const cv::Vec6d& p){
+        return SE3(SO3::exp(cv::Vec3d(p[0],p[1],p[2])),cv::Vec3d(p[3],p[4],p[5]));
+    }
+    cv::Vec6d toLie() const{
+        cv::Vec3d w=rot.log();
+        return cv::Vec6d(w[0],w[1],w[2],t[0],t[1],t[2]);
+    }
+
+    static SE3 exp(const cv::Vec6d& xi){
+        cv::Vec3d w(xi[0],xi[1],xi[2]);
+        cv::Vec3d rho(xi[3],xi[4],xi[5]);
+        double th2=w.dot(w);
+        cv::Matx33d K=se3_hat(w);
+        double b,c;
+        if(th2<1e-16){
+            b=.5-th2/24.0;
+            c=1.0/6.0-th2/120.0;
+        }else{
+            double th=std::sqrt(th2);
+            b=(1.0-std::cos(th))/th2;
+            c=(th-std::sin(th))/(th2*th);
+        }
+        cv::Matx33d V=cv::Matx33d::eye()+b*K+c*(K*K);
+        return SE3(SO3::exp(w),V*rho);
+    }
+    cv::Vec6d log() const{
+        cv::Vec3d w=rot.log();
+        double th2=w.dot(w);
+        cv::Matx33d K=se3_hat(w);
+        double e;
+        if(th2<1e-16){
+            e=1.0/12.0+th2/720.0;
+        }else{
+            double th=std::sqrt(th2);
+            e=(1.0-th*std::sin(th)/(2.0*(1.0-std::cos(th))))/th2;
+        }
+        cv::Vec3d rho=(cv::Matx33d::eye()-.5*K+e*(K*K))*t;
+        return cv::Vec6d(w[0],w[1],w[2],rho[0],rho[1],rho[2]);
+    }
+
+    SE3 operator*(const SE3& B) const{return SE3(rot*B.rot,rot*B.t+t);}
+    cv::Vec3d operator*(const cv::Vec3d& x) const{return rot*x+t;}
+    SE3 inverse() const{
+        SO3 Rt=rot.inverse();
+        return SE3(Rt,-(Rt*t));
+    }
+
+    cv::Matx44d matrix() const{
+        const cv::Matx33d& R=rot.R;
+        return cv::Matx44d(R(0,0),R(0,1),R(0,2),t[0],
+                           R(1,0),R(1,1),R(1,2),t[1],
+                           R(2,0),R(2,1),R(2,2),t[2],
+                           0.0,   0.0,   0.0,   1.0);
+    }
+};
+
+#endif
@@ -3,12 +3,13 @@
 #include <opencv2/calib3d/calib3d.hpp>
 #ifndef DTAM_UTILS_HPP
 #define DTAM_UTILS_HPP
+#include "se3.hpp"
 using namespace cv;
 static Mat make4x4(const Mat& mat){
     
     if (mat.rows!=4||mat.cols!=4){
         Mat tmp=Mat::eye(4,4,mat.type());
-        tmp(Range(0,mat.rows),Range(0,mat.cols))=mat*1.0;
+        mat.copyTo(tmp(Range(0,mat.rows),Range(0,mat.cols)));
 
         return tmp;
     }else{
@@ -16,6 +17,13 @@ static Mat make4x4(const Mat& mat){
     }
 }
 
+static Matx44d make4x4(const Matx33d& mat){
+    return Matx44d(mat(0,0),mat(0,1),mat(0,2),0.0,
+                   mat(1,0),mat(1,1),mat(1,2),0.0,
+                   mat(2,0),mat(2,1),mat(2,2),0.0,
+                   0.0,     0.0,     0.0,     1.0);
+}
+
 static Mat rodrigues(const Mat& p){
     
     Mat tmp;
@@ -23,38 +31,49 @@ static Mat rodrigues(const Mat& p){
     return tmp;
 }
 
-static void LieToRT(InputArray Lie, OutputArray _R, OutputArray _T){
-    Mat p = Lie.getMat();
-    _R.create(3,3,CV_64FC1);
-    Mat R = _R.getMat();
-    _T.create(3,1,CV_64FC1);
-    Mat T = _T.getMat();
-    if(p.cols==1){
-        p = p.t();
-    }
-        
-    rodrigues(p.colRange(Range(0,3))).copyTo(R);
-    Mat(p.colRange(Range(3,6)).t()).copyTo(T);
-
+//Adapters from the cv::Mat pose interface to the fixed size SE3 in se3.hpp.
+//Only the outputs allocate; the math itself is all on the stack. Hot paths
+// use the Vec6d forms with toLieVec()/setLie() and allocate nothing.
+template<int m,int n>
+static Matx<double,m,n> toMatx(InputArray _A){
+    Mat A=_A.getMat();
+    CV_Assert(A.total()*A.channels()==m*n);
+    Matx<double,m,n> out;
+    Mat header(A.rows,A.cols,CV_MAKETYPE(CV_64F,A.channels()),out.val);
+    A.convertTo(header,CV_64F);
+    return out;
+}
+template<int m,int n>
+static void fromMatx(const Matx<double,m,n>& a,OutputArray out,int rows,int cols,int type){
+    Mat(rows,cols,CV_64FC1,(void*)a.val).convertTo(out,type);
+}
+static Vec6d toLieVec(InputArray Lie){
+    return Vec6d(toMatx<6,1>(Lie).val);
+}
+//Writes A over Lie's own storage, which is only allocated if Lie is not
+// already 1x6. For per-frame code, where the returning forms would allocate.
+static void setLie(const Vec6d& A, Mat& Lie){
+    fromMatx(Matx<double,6,1>(A.val),Lie,1,6,Lie.empty() ? CV_64FC1 : Lie.type());
+}
+//Lets go of m's buffer if another header shares it or m does not own it, so
+// a function writing m as its output reuses the buffer only when no one
+// else would see the write.
+static void unshare(Mat& m){
+    if(!m.u || m.u->refcount>1)
+        m.release();
+}
 
+static void LieToRT(InputArray Lie, OutputArray _R, OutputArray _T){
+    SE3 A=SE3::fromLie(toLieVec(Lie));
+    fromMatx(A.rot.R,_R,3,3,CV_64FC1);
+    fromMatx(A.t,_T,3,1,CV_64FC1);
 }
 
 
 static void RTToLie(InputArray _R, InputArray _T, OutputArray Lie ){
-
-    Mat R = _R.getMat();
-    Mat T = _T.getMat();
-    Lie.create(1,6,T.type());
-    
-    Mat p = Lie.getMat(); 
-    assert(p.size()==Size(6,1));
-    p=p.reshape(1,6);
-    if(T.rows==1){
-        T = T.t();
-    }
-    
-    rodrigues(R).copyTo(p.rowRange(Range(0,3)));
-    T.copyTo(p.rowRange(Range(3,6)));
+    int type=_T.type();
+    SE3 A(toMatx<3,3>(_R),Vec3d(toMatx<3,1>(_T).val));
+    fromMatx(A.toLie(),Lie,1,6,type);
     assert(Lie.size()==Size(6,1));
 }
 static Mat RTToLie(InputArray _R, InputArray _T){
@@ -64,43 +83,26 @@ static Mat RTToLie(InputArray _R, InputArray _T){
     return P;
 }
 static void PToLie(InputArray _P, OutputArray Lie){
-
-    Mat P = _P.getMat();
-    assert(P.cols == P.rows && P.rows == 4);
-    Mat R = P(Range(0,3),Range(0,3));
-    Mat T = P(Range(0,3),Range(3,4));
-    RTToLie(R,T,Lie);
+    int type=_P.type();
+    assert(_P.size()==Size(4,4));
+    SE3 A(toMatx<4,4>(_P));
+    fromMatx(A.toLie(),Lie,1,6,type);
     assert(Lie.size()==Size(6,1));
 }
 static void RTToP(InputArray _R, InputArray _T, OutputArray _P ){
-    
-    Mat R = _R.getMat();
-    Mat T = _T.getMat();
-    Mat P = _P.getMat();
-    hconcat(R,T,P);
-    make4x4(P).copyTo(_P);
+    int type=_R.type();
+    SE3 A(toMatx<3,3>(_R),Vec3d(toMatx<3,1>(_T).val));
+    fromMatx(A.matrix(),_P,4,4,type);
 }
 static Mat RTToP(InputArray _R, InputArray _T){
-    
-    Mat R = _R.getMat();
-    Mat T = _T.getMat();
     Mat P;
-    hconcat(R,T,P);
-    make4x4(P);
+    RTToP(_R,_T,P);
     return P;
 }
 static void LieToP(InputArray Lie, OutputArray _P){
-    Mat p = Lie.getMat();
-    _P.create(4,4,p.type());
-    Mat P = _P.getMat();
-    if(p.cols==1){
-        p = p.t();
-    } 
-    
-    Mat R=rodrigues(p.colRange(Range(0,3)));
-    Mat T=p.colRange(Range(3,6)).t();
-    hconcat(R,T,P);
-    make4x4(P).copyTo(_P);
+    int type=Lie.type();
+    SE3 A=SE3::fromLie(toLieVec(Lie));
+    fromMatx(A.matrix(),_P,4,4,type);
 }
 static Mat LieToP(InputArray Lie){
     Mat P;
@@ -108,25 +110,27 @@ static Mat LieToP(InputArray Lie){
     return P;
 }
 
+static Vec6d LieSub(const Vec6d& A, const Vec6d& B){
+    return (SE3::fromLie(A)*SE3::fromLie(B).inverse()).toLie();
+}
+static Vec6d LieAdd(const Vec6d& A, const Vec6d& B){
+    return (SE3::fromLie(A)*SE3::fromLie(B)).toLie();
+}
+//s times the motion A, along the SE(3) geodesic
+static Vec6d LieScale(const Vec6d& A, double s){
+    return SE3::exp(s*SE3::fromLie(A).log()).toLie();
+}
+
 static Mat LieSub(Mat A, Mat B){
-    Mat Pa;
-    Mat Pb;
-    LieToP(A,Pa);
-    LieToP(B,Pb);
-    Mat out;
     assert(A.size()==Size(6,1) && B.size()==Size(6,1));
-    PToLie(Pa*Pb.inv(),out);
+    Mat out;
+    fromMatx(LieSub(toLieVec(A),toLieVec(B)),out,1,6,A.type());
     return out;
 }
 
 static Mat LieAdd(Mat A, Mat B){
-    Mat Pa;
-    Mat Pb;
-    
-    LieToP(A,Pa);
-    LieToP(B,Pb);
     Mat out;
-    PToLie(Pa*Pb,out);
+    fromMatx(LieAdd(toLieVec(A),toLieVec(B)),out,1,6,A.type());
     return out;
 }
 